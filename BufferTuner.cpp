@@ -0,0 +1,30 @@
+#include <algorithm>
+
+#include "BufferTuner.h"
+
+// Requeue times to see before recommending anything.
+static constexpr uint64_t kMinSamples = 60;
+
+void BufferTuner::frameDequeued(uint64_t timestamp, uint64_t sequence) {
+    // Gaps are frames the sensor did produce, so divide by them; a
+    // restart (sequence going back) just starts over.
+    if (lastTimestamp_ && sequence > lastSequence_ && timestamp > lastTimestamp_) {
+        uint64_t interval = (timestamp - lastTimestamp_) / (sequence - lastSequence_);
+        uint64_t smoothed = interval_.load(std::memory_order_relaxed);
+        interval_.store(smoothed ? (smoothed * 7 + interval) / 8 : interval, std::memory_order_relaxed);
+    }
+    lastTimestamp_ = timestamp;
+    lastSequence_ = sequence;
+}
+
+unsigned int BufferTuner::recommend(size_t bufferBytes, size_t memoryBudget) const {
+    uint64_t interval = frameInterval();
+    if (!interval || requeue_.count() < kMinSamples)
+        return 0;
+    uint64_t held = requeue_.percentile(99);
+    uint64_t buffers = (held + interval - 1) / interval + 2;
+    buffers = std::min<uint64_t>(std::max<uint64_t>(buffers, minBuffers_), maxBuffers_);
+    if (memoryBudget && bufferBytes)
+        buffers = std::min<uint64_t>(buffers, std::max<size_t>(memoryBudget / bufferBytes, 1));
+    return buffers;
+}
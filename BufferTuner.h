@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "LatencyStats.h"
+
+// Works out how many capture buffers keep the sensor fed. A buffer is out
+// of the camera's hands from request completion until it is requeued; by
+// Little's law that takes (requeue time / frame interval) buffers, plus one
+// being filled and one queued behind it. The p99 requeue time is used so
+// occasional slow frames don't starve the sensor either.
+class BufferTuner {
+    public:
+        BufferTuner(unsigned int minBuffers = 2, unsigned int maxBuffers = 32)
+            : minBuffers_(minBuffers), maxBuffers_(maxBuffers) {}
+
+        // From the reading thread, for every frame handed out.
+        void frameDequeued(uint64_t timestamp, uint64_t sequence);
+        // From any thread, when a buffer goes back to the camera.
+        void frameReturned(uint64_t requeueNs) { requeue_.record(requeueNs); }
+        // Forgets the requeue times, e.g. after a reconfiguration.
+        void reset() { requeue_.reset(); }
+
+        uint64_t frameInterval() const { return interval_.load(std::memory_order_relaxed); }
+        // Smallest count that covers the requeue times seen since reset(),
+        // but no more buffers of bufferBytes than fit in memoryBudget (0 for
+        // no limit). 0 while there is too little to go on.
+        unsigned int recommend(size_t bufferBytes, size_t memoryBudget) const;
+
+    private:
+        unsigned int minBuffers_;
+        unsigned int maxBuffers_;
+        LatencyHistogram requeue_;
+        std::atomic<uint64_t> interval_{0};  // ns, smoothed
+        uint64_t lastTimestamp_ = 0;
+        uint64_t lastSequence_ = 0;
+};
@@ -0,0 +1,98 @@
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CameraCache.h"
+
+bool CameraCache::load(const std::string &path) {
+    *this = CameraCache();
+    std::ifstream in(path);
+    if (!in)
+        return false;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        unsigned int index;
+        char field[32];
+        if (key == "camera") {
+            cameraId = value;
+        } else if (key == "request") {
+            request = value;
+        } else if (key == "exposureTime") {
+            exposureTime = atoi(value.c_str());
+        } else if (key == "analogueGain") {
+            analogueGain = atof(value.c_str());
+        } else if (key == "colourGains") {
+            if (sscanf(value.c_str(), "%f,%f", &colourGains[0], &colourGains[1]) != 2)
+                colourGains[0] = colourGains[1] = 0;
+        } else if (sscanf(key.c_str(), "stream%u.%31s", &index, field) == 2 && index < 8) {
+            if (streams.size() <= index)
+                streams.resize(index + 1);
+            StreamConfig &stream = streams[index];
+            std::string name = field;
+            if (name == "size")
+                sscanf(value.c_str(), "%ux%u", &stream.width, &stream.height);
+            else if (name == "pixelFormat")
+                stream.pixelFormat = value;
+            else if (name == "stride")
+                stream.stride = atoi(value.c_str());
+            else if (name == "frameSize")
+                stream.frameSize = atoi(value.c_str());
+            else if (name == "bufferCount")
+                stream.bufferCount = atoi(value.c_str());
+        }
+    }
+
+    for (const StreamConfig &stream : streams) {
+        if (!stream.width || !stream.height || stream.pixelFormat.empty()) {
+            std::cerr << path << ": incomplete stream configuration, ignoring the cache" << std::endl;
+            *this = CameraCache();
+            return false;
+        }
+    }
+    return !cameraId.empty();
+}
+
+bool CameraCache::save(const std::string &path) const {
+    std::ostringstream out;
+    out << "camera=" << cameraId << "\n"
+        << "request=" << request << "\n";
+    for (size_t i = 0; i < streams.size(); i++) {
+        const StreamConfig &s = streams[i];
+        out << "stream" << i << ".size=" << s.width << "x" << s.height << "\n"
+            << "stream" << i << ".pixelFormat=" << s.pixelFormat << "\n"
+            << "stream" << i << ".stride=" << s.stride << "\n"
+            << "stream" << i << ".frameSize=" << s.frameSize << "\n"
+            << "stream" << i << ".bufferCount=" << s.bufferCount << "\n";
+    }
+    if (exposureTime) {
+        out << "exposureTime=" << exposureTime << "\n"
+            << "analogueGain=" << analogueGain << "\n"
+            << "colourGains=" << colourGains[0] << "," << colourGains[1] << "\n";
+    }
+
+    std::string data = out.str();
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to write " << tmp << std::endl;
+        return false;
+    }
+    bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str())) {
+        std::cerr << "Failed to write " << path << std::endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
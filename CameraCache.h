@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// What LibCamera learnt about the camera on an earlier run, kept in a small
+// text file (key=value lines) so the next cold start can skip enumeration,
+// start from an already validated configuration and seed AE/AWB with the
+// last converged values instead of settling from scratch.
+struct CameraCache {
+    struct StreamConfig {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::string pixelFormat;
+        uint32_t stride = 0;
+        uint32_t frameSize = 0;
+        uint32_t bufferCount = 0;
+    };
+
+    std::string cameraId;
+    // configureStill() arguments the streams were validated for.
+    std::string request;
+    std::vector<StreamConfig> streams;
+
+    // Last converged exposure; exposureTime 0 when unknown.
+    int32_t exposureTime = 0;
+    float analogueGain = 0;
+    float colourGains[2] = { 0, 0 };
+
+    // False if path doesn't exist or can't be parsed; the cache is then
+    // left empty.
+    bool load(const std::string &path);
+    // Replaces path atomically, so a power cut leaves the old or the new
+    // file, never half of one.
+    bool save(const std::string &path) const;
+};
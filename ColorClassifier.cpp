@@ -0,0 +1,261 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLOR_CLASSIFIER_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define COLOR_CLASSIFIER_NEON 1
+#endif
+
+#include "ColorClassifier.h"
+
+// OpenCV's BGR2HSV divides through fixed-point reciprocal tables:
+// sdiv[v] = round((255 << 12) / v) and hdiv[d] = round((180 << 12) / (6 * d)),
+// both 0 for a zero index. Rounding the single-precision quotient gives the
+// same values (checked for all 256 entries), which is what the SIMD paths do.
+static const int kHsvShift = 12;
+static const float kSdivScale = 255 << kHsvShift;
+static const float kHdivScale = (180 << kHsvShift) / 6;
+
+namespace {
+
+struct DivTables {
+    int32_t sdiv[256];
+    int32_t hdiv[256];
+
+    DivTables() {
+        sdiv[0] = hdiv[0] = 0;
+        for (int i = 1; i < 256; i++) {
+            sdiv[i] = __builtin_lrint((255 << kHsvShift) / (1. * i));
+            hdiv[i] = __builtin_lrint((180 << kHsvShift) / (6. * i));
+        }
+    }
+};
+
+const DivTables &divTables() {
+    static const DivTables tables;
+    return tables;
+}
+
+inline void bgrToHsv(int b, int g, int r, const DivTables &t, int *h_out, int *s_out, int *v_out) {
+    int v = b > g ? b : g;
+    v = v > r ? v : r;
+    int vmin = b < g ? b : g;
+    vmin = vmin < r ? vmin : r;
+    int diff = v - vmin;
+    int vr = v == r ? -1 : 0;
+    int vg = v == g ? -1 : 0;
+
+    int s = (diff * t.sdiv[v] + (1 << (kHsvShift - 1))) >> kHsvShift;
+    int h = (vr & (g - b)) + (~vr & ((vg & (b - r + 2 * diff)) + ((~vg) & (r - g + 4 * diff))));
+    h = (h * t.hdiv[diff] + (1 << (kHsvShift - 1))) >> kHsvShift;
+    h += h < 0 ? 180 : 0;
+
+    *h_out = h;
+    *s_out = s;
+    *v_out = v;
+}
+
+inline void classifyPixel(int b, int g, int r, const DivTables &t, uint32_t *counts) {
+    int h, s, v;
+    bgrToHsv(b, g, r, t, &h, &s, &v);
+    for (int c = 0; c < kColorClasses; c++) {
+        const ColorRange &range = kColorRanges[c];
+        counts[c] += h >= range.lower[0] && h <= range.upper[0] &&
+                     s >= range.lower[1] && s <= range.upper[1] &&
+                     v >= range.lower[2] && v <= range.upper[2];
+    }
+}
+
+void classifyRowScalar(const uint8_t *p, uint32_t width, const DivTables &t, uint32_t *counts) {
+    for (uint32_t x = 0; x < width; x++, p += 3)
+        classifyPixel(p[0], p[1], p[2], t, counts);
+}
+
+#ifdef COLOR_CLASSIFIER_X86
+
+// 8 pixels held as one 32-bit lane each.
+__attribute__((target("avx2")))
+inline void classify8Avx2(__m256i b, __m256i g, __m256i r, __m256i *acc) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (kHsvShift - 1));
+
+    __m256i v = _mm256_max_epi32(_mm256_max_epi32(b, g), r);
+    __m256i vmin = _mm256_min_epi32(_mm256_min_epi32(b, g), r);
+    __m256i diff = _mm256_sub_epi32(v, vmin);
+    __m256i vr = _mm256_cmpeq_epi32(v, r);
+    __m256i vg = _mm256_cmpeq_epi32(v, g);
+
+    // Reciprocals for zero indices come out as INT_MIN and are masked to 0.
+    __m256i sdiv = _mm256_cvtps_epi32(_mm256_div_ps(_mm256_set1_ps(kSdivScale), _mm256_cvtepi32_ps(v)));
+    sdiv = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, zero), sdiv);
+    __m256i hdiv = _mm256_cvtps_epi32(_mm256_div_ps(_mm256_set1_ps(kHdivScale), _mm256_cvtepi32_ps(diff)));
+    hdiv = _mm256_andnot_si256(_mm256_cmpeq_epi32(diff, zero), hdiv);
+
+    __m256i s = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(diff, sdiv), round), kHsvShift);
+
+    __m256i hg = _mm256_add_epi32(_mm256_sub_epi32(b, r), _mm256_slli_epi32(diff, 1));
+    __m256i hb = _mm256_add_epi32(_mm256_sub_epi32(r, g), _mm256_slli_epi32(diff, 2));
+    __m256i h = _mm256_blendv_epi8(_mm256_blendv_epi8(hb, hg, vg), _mm256_sub_epi32(g, b), vr);
+    h = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(h, hdiv), round), kHsvShift);
+    h = _mm256_add_epi32(h, _mm256_and_si256(_mm256_cmpgt_epi32(zero, h), _mm256_set1_epi32(180)));
+
+    for (int c = 0; c < kColorClasses; c++) {
+        const ColorRange &range = kColorRanges[c];
+        __m256i in = _mm256_and_si256(
+            _mm256_cmpgt_epi32(h, _mm256_set1_epi32(range.lower[0] - 1)),
+            _mm256_cmpgt_epi32(_mm256_set1_epi32(range.upper[0] + 1), h));
+        in = _mm256_and_si256(in, _mm256_cmpgt_epi32(s, _mm256_set1_epi32(range.lower[1] - 1)));
+        in = _mm256_and_si256(in, _mm256_cmpgt_epi32(_mm256_set1_epi32(range.upper[1] + 1), s));
+        in = _mm256_and_si256(in, _mm256_cmpgt_epi32(v, _mm256_set1_epi32(range.lower[2] - 1)));
+        in = _mm256_and_si256(in, _mm256_cmpgt_epi32(_mm256_set1_epi32(range.upper[2] + 1), v));
+        // Matching lanes are -1.
+        acc[c] = _mm256_sub_epi32(acc[c], in);
+    }
+}
+
+__attribute__((target("avx2")))
+void classifyRowAvx2(const uint8_t *p, uint32_t width, const DivTables &t, uint32_t *counts) {
+    // Split 16 packed BGR pixels (48 bytes) into B, G and R vectors.
+    const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+    __m256i acc[kColorClasses];
+    for (int c = 0; c < kColorClasses; c++)
+        acc[c] = _mm256_setzero_si256();
+
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16, p += 48) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+        __m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32));
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(m, b1)), _mm_shuffle_epi8(z, b2));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(m, g1)), _mm_shuffle_epi8(z, g2));
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(m, r1)), _mm_shuffle_epi8(z, r2));
+
+        classify8Avx2(_mm256_cvtepu8_epi32(b), _mm256_cvtepu8_epi32(g), _mm256_cvtepu8_epi32(r), acc);
+        classify8Avx2(_mm256_cvtepu8_epi32(_mm_srli_si128(b, 8)), _mm256_cvtepu8_epi32(_mm_srli_si128(g, 8)),
+                      _mm256_cvtepu8_epi32(_mm_srli_si128(r, 8)), acc);
+    }
+
+    for (int c = 0; c < kColorClasses; c++) {
+        uint32_t lanes[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc[c]);
+        for (int i = 0; i < 8; i++)
+            counts[c] += lanes[i];
+    }
+    classifyRowScalar(p, width - x, t, counts);
+}
+
+#endif
+
+#ifdef COLOR_CLASSIFIER_NEON
+
+// 4 pixels held as one 32-bit lane each.
+inline void classify4Neon(int32x4_t b, int32x4_t g, int32x4_t r, uint32x4_t *acc) {
+    const int32x4_t zero = vdupq_n_s32(0);
+    const int32x4_t round = vdupq_n_s32(1 << (kHsvShift - 1));
+
+    int32x4_t v = vmaxq_s32(vmaxq_s32(b, g), r);
+    int32x4_t vmin = vminq_s32(vminq_s32(b, g), r);
+    int32x4_t diff = vsubq_s32(v, vmin);
+    uint32x4_t vr = vceqq_s32(v, r);
+    uint32x4_t vg = vceqq_s32(v, g);
+
+    int32x4_t sdiv = vcvtnq_s32_f32(vdivq_f32(vdupq_n_f32(kSdivScale), vcvtq_f32_s32(v)));
+    sdiv = vbslq_s32(vceqq_s32(v, zero), zero, sdiv);
+    int32x4_t hdiv = vcvtnq_s32_f32(vdivq_f32(vdupq_n_f32(kHdivScale), vcvtq_f32_s32(diff)));
+    hdiv = vbslq_s32(vceqq_s32(diff, zero), zero, hdiv);
+
+    int32x4_t s = vshrq_n_s32(vaddq_s32(vmulq_s32(diff, sdiv), round), kHsvShift);
+
+    int32x4_t hg = vaddq_s32(vsubq_s32(b, r), vshlq_n_s32(diff, 1));
+    int32x4_t hb = vaddq_s32(vsubq_s32(r, g), vshlq_n_s32(diff, 2));
+    int32x4_t h = vbslq_s32(vr, vsubq_s32(g, b), vbslq_s32(vg, hg, hb));
+    h = vshrq_n_s32(vaddq_s32(vmulq_s32(h, hdiv), round), kHsvShift);
+    h = vaddq_s32(h, vandq_s32(vreinterpretq_s32_u32(vcltq_s32(h, zero)), vdupq_n_s32(180)));
+
+    for (int c = 0; c < kColorClasses; c++) {
+        const ColorRange &range = kColorRanges[c];
+        uint32x4_t in = vandq_u32(vcgeq_s32(h, vdupq_n_s32(range.lower[0])), vcleq_s32(h, vdupq_n_s32(range.upper[0])));
+        in = vandq_u32(in, vcgeq_s32(s, vdupq_n_s32(range.lower[1])));
+        in = vandq_u32(in, vcleq_s32(s, vdupq_n_s32(range.upper[1])));
+        in = vandq_u32(in, vcgeq_s32(v, vdupq_n_s32(range.lower[2])));
+        in = vandq_u32(in, vcleq_s32(v, vdupq_n_s32(range.upper[2])));
+        acc[c] = vsubq_u32(acc[c], in);
+    }
+}
+
+void classifyRowNeon(const uint8_t *p, uint32_t width, const DivTables &t, uint32_t *counts) {
+    uint32x4_t acc[kColorClasses];
+    for (int c = 0; c < kColorClasses; c++)
+        acc[c] = vdupq_n_u32(0);
+
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16, p += 48) {
+        uint8x16x3_t bgr = vld3q_u8(p);
+        uint16x8_t b16[2] = { vmovl_u8(vget_low_u8(bgr.val[0])), vmovl_u8(vget_high_u8(bgr.val[0])) };
+        uint16x8_t g16[2] = { vmovl_u8(vget_low_u8(bgr.val[1])), vmovl_u8(vget_high_u8(bgr.val[1])) };
+        uint16x8_t r16[2] = { vmovl_u8(vget_low_u8(bgr.val[2])), vmovl_u8(vget_high_u8(bgr.val[2])) };
+        for (int i = 0; i < 2; i++) {
+            classify4Neon(vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(b16[i]))),
+                          vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(g16[i]))),
+                          vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(r16[i]))), acc);
+            classify4Neon(vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(b16[i]))),
+                          vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(g16[i]))),
+                          vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(r16[i]))), acc);
+        }
+    }
+
+    for (int c = 0; c < kColorClasses; c++)
+        counts[c] += vaddvq_u32(acc[c]);
+    classifyRowScalar(p, width - x, t, counts);
+}
+
+#endif
+
+}
+
+ColorClassifier::ColorClassifier() {
+    divTables();
+#ifdef COLOR_CLASSIFIER_X86
+    // May run from a static constructor, before libgcc has probed the CPU.
+    __builtin_cpu_init();
+    use_avx2_ = __builtin_cpu_supports("avx2");
+#endif
+}
+
+void ColorClassifier::toHsv(uint8_t b, uint8_t g, uint8_t r, uint8_t hsv[3]) {
+    int h, s, v;
+    bgrToHsv(b, g, r, divTables(), &h, &s, &v);
+    hsv[0] = h;
+    hsv[1] = s;
+    hsv[2] = v;
+}
+
+void ColorClassifier::classify(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride,
+                               uint32_t counts[kColorClasses]) const {
+    const DivTables &t = divTables();
+    memset(counts, 0, kColorClasses * sizeof(counts[0]));
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = data + y * stride;
+#if defined(COLOR_CLASSIFIER_X86)
+        if (use_avx2_) {
+            classifyRowAvx2(row, width, t, counts);
+            continue;
+        }
+#elif defined(COLOR_CLASSIFIER_NEON)
+        classifyRowNeon(row, width, t, counts);
+        continue;
+#endif
+        classifyRowScalar(row, width, t, counts);
+    }
+}
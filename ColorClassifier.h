@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+// HSV ranges in OpenCV's 8-bit convention (H 0-180, S and V 0-255), both
+// bounds inclusive, exactly as they were passed to cv::inRange().
+struct ColorRange {
+    const char *name;
+    uint8_t lower[3];
+    uint8_t upper[3];
+};
+
+constexpr ColorRange kColorRanges[] = {
+    { "blue",   { 110,  50,  70 }, { 130, 255, 255 } },
+    { "green",  {  36,  25,  25 }, {  70, 255, 255 } },
+    { "yellow", {  20, 100, 100 }, {  30, 255, 255 } },
+    { "black",  {   0,   0,   0 }, { 180, 255,  80 } },
+    { "white",  {   0,   0, 200 }, { 180,  20, 255 } },
+    { "brown",  {  10, 100,  20 }, {  20, 255, 200 } },
+};
+
+constexpr int kColorClasses = sizeof(kColorRanges) / sizeof(kColorRanges[0]);
+
+enum ColorClass { Blue, Green, Yellow, Black, White, Brown };
+
+// Counts how many pixels of a BGR image (libcamera's formats::RGB888 memory
+// layout) fall in each of kColorRanges. Every pixel is converted to HSV with
+// the same integer arithmetic as cv::cvtColor(COLOR_BGR2HSV) and tested
+// against all ranges in a single pass, so the counts match the old
+// cvtColor + inRange + countNonZero sequence exactly without touching the
+// frame more than once or allocating anything.
+//
+// Uses AVX2 when the CPU has it, NEON on AArch64 and plain C++ otherwise.
+class ColorClassifier {
+    public:
+        ColorClassifier();
+
+        void classify(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride,
+                      uint32_t counts[kColorClasses]) const;
+
+        // Scalar conversion of one pixel, bit exact with cv::cvtColor.
+        static void toHsv(uint8_t b, uint8_t g, uint8_t r, uint8_t hsv[3]);
+        // Whether an HSV triple lies inside range (bounds inclusive).
+        static bool inRange(const uint8_t hsv[3], const ColorRange &range) {
+            return hsv[0] >= range.lower[0] && hsv[0] <= range.upper[0] &&
+                   hsv[1] >= range.lower[1] && hsv[1] <= range.upper[1] &&
+                   hsv[2] >= range.lower[2] && hsv[2] <= range.upper[2];
+        }
+
+    private:
+        bool use_avx2_ = false;
+};
@@ -0,0 +1,72 @@
+#include <stdexcept>
+#include <string.h>
+
+#include "ColorLut.h"
+
+ColorLut::ColorLut(int bits, const ColorRange *ranges, int count)
+    : bits_(bits), shift_(8 - bits), count_(count) {
+    if (bits < 4 || bits > 7)
+        throw std::runtime_error("colour table needs 4 to 7 bits per channel");
+    if (count > 8)
+        throw std::runtime_error("colour table supports at most 8 classes");
+
+    // Decide every cell by majority over the colours it stands for. Walking
+    // the colours in cell order keeps the votes for one cell together.
+    const int cells = 1 << bits;
+    const int span = 1 << shift_;
+    const int half = span * span * span / 2;
+    table_.assign(1u << (3 * bits), 0);
+    for (int qb = 0; qb < cells; qb++) {
+        for (int qg = 0; qg < cells; qg++) {
+            for (int qr = 0; qr < cells; qr++) {
+                int votes[8] = {};
+                for (int b = qb << shift_; b < (qb + 1) << shift_; b++) {
+                    for (int g = qg << shift_; g < (qg + 1) << shift_; g++) {
+                        for (int r = qr << shift_; r < (qr + 1) << shift_; r++) {
+                            uint8_t hsv[3];
+                            ColorClassifier::toHsv(b, g, r, hsv);
+                            for (int c = 0; c < count; c++)
+                                votes[c] += ColorClassifier::inRange(hsv, ranges[c]);
+                        }
+                    }
+                }
+                uint8_t mask = 0;
+                for (int c = 0; c < count; c++)
+                    if (votes[c] > half)
+                        mask |= 1 << c;
+                table_[(qb << (2 * bits)) | (qg << bits) | qr] = mask;
+            }
+        }
+    }
+}
+
+void ColorLut::classify(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride,
+                        uint32_t *counts) const {
+    // Histogram the masks rather than the classes: one increment per pixel,
+    // spread over four tables so back-to-back equal masks don't serialise.
+    uint32_t hist[4][256];
+    memset(hist, 0, sizeof(hist));
+    const uint8_t *table = table_.data();
+    const int shift = shift_, bits = bits_;
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *p = data + y * stride;
+        uint32_t x = 0;
+        for (; x + 4 <= width; x += 4, p += 12) {
+            hist[0][table[((p[0] >> shift) << (2 * bits)) | ((p[1] >> shift) << bits) | (p[2] >> shift)]]++;
+            hist[1][table[((p[3] >> shift) << (2 * bits)) | ((p[4] >> shift) << bits) | (p[5] >> shift)]]++;
+            hist[2][table[((p[6] >> shift) << (2 * bits)) | ((p[7] >> shift) << bits) | (p[8] >> shift)]]++;
+            hist[3][table[((p[9] >> shift) << (2 * bits)) | ((p[10] >> shift) << bits) | (p[11] >> shift)]]++;
+        }
+        for (; x < width; x++, p += 3)
+            hist[0][table[((p[0] >> shift) << (2 * bits)) | ((p[1] >> shift) << bits) | (p[2] >> shift)]]++;
+    }
+
+    memset(counts, 0, count_ * sizeof(counts[0]));
+    for (int m = 1; m < 256; m++) {
+        uint32_t n = hist[0][m] + hist[1][m] + hist[2][m] + hist[3][m];
+        for (int c = 0; c < count_; c++)
+            if (m & (1 << c))
+                counts[c] += n;
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "ColorClassifier.h"
+
+// Precomputed RGB -> colour class lookup. The HSV ranges are fixed, so the
+// class of every colour can be worked out once: RGB888 is quantised to
+// `bits` (5 or 6) bits per channel and each cell stores a bitmask of the
+// ranges that cover most of the colours falling in it. Classifying a frame
+// is then one table load per pixel with no HSV conversion at all.
+//
+// The result is approximate near range boundaries; colorbench reports how
+// far the counts are from the exact ColorClassifier/OpenCV ones. Up to 8
+// classes are supported, taken from any ColorRange table.
+class ColorLut {
+    public:
+        ColorLut(int bits = 6, const ColorRange *ranges = kColorRanges, int count = kColorClasses);
+
+        // data is a BGR (formats::RGB888) image; counts has one entry per range.
+        void classify(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride,
+                      uint32_t *counts) const;
+
+        int bits() const { return bits_; }
+        int classes() const { return count_; }
+
+    private:
+        int bits_;
+        int shift_;
+        int count_;
+        std::vector<uint8_t> table_;
+};
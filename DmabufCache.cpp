@@ -0,0 +1,69 @@
+#include <errno.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DmabufCache.h"
+
+uint8_t *DmabufCache::map(int fd, size_t length) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        std::cerr << "Failed to stat dmabuf: " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+
+    std::pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+    auto it = mappings_.find(key);
+    if (it != mappings_.end()) {
+        if (it->second.length >= length) {
+            it->second.users++;
+            return it->second.data;
+        }
+        std::cerr << "Failed to map dmabuf: size " << it->second.length << ", " << length << " needed" << std::endl;
+        return nullptr;
+    }
+
+    // dmabufs report their size through lseek. The whole buffer is mapped
+    // straight away: pointers into a mapping are handed out, so it can't
+    // be replaced by a longer one later.
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0 || static_cast<size_t>(size) < length) {
+        std::cerr << "Failed to map dmabuf: size " << (long long)size << ", " << length << " needed" << std::endl;
+        return nullptr;
+    }
+    length = size;
+    void *memory = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        std::cerr << "Failed to map dmabuf: " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+    mappings_[key] = { static_cast<uint8_t *>(memory), length, 1 };
+    return static_cast<uint8_t *>(memory);
+}
+
+void DmabufCache::unmap(const uint8_t *data) {
+    for (auto it = mappings_.begin(); it != mappings_.end(); ++it) {
+        if (it->second.data != data)
+            continue;
+        if (!--it->second.users) {
+            munmap(it->second.data, it->second.length);
+            mappings_.erase(it);
+        }
+        return;
+    }
+}
+
+void DmabufCache::clear() {
+    for (auto &iter : mappings_)
+        munmap(iter.second.data, iter.second.length);
+    mappings_.clear();
+}
+
+size_t DmabufCache::mappedBytes() const {
+    size_t bytes = 0;
+    for (const auto &iter : mappings_)
+        bytes += iter.second.length;
+    return bytes;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <utility>
+
+// Maps dmabufs into the process once each. Entries are keyed by the
+// dmabuf's inode rather than by fd number: planes of one buffer may come
+// with separate (dup'ed) fds, and fd numbers get reused once buffers are
+// freed. Every mapping covers the whole dmabuf, so a plane is found at
+// map() + plane.offset.
+class DmabufCache {
+    public:
+        DmabufCache(){};
+        ~DmabufCache() { clear(); }
+
+        // Returns the start of fd's dmabuf mapped read-only, or nullptr on
+        // failure. length is how much of it the caller needs at least; a
+        // dmabuf that is shorter, or doesn't tell its size, fails.
+        uint8_t *map(int fd, size_t length);
+        // Undoes one map() of the dmabuf mapped at data; the last one
+        // unmaps it.
+        void unmap(const uint8_t *data);
+        // Unmaps everything. Only call once no frame can be in use.
+        void clear();
+
+        size_t size() const { return mappings_.size(); }
+        size_t mappedBytes() const;
+
+    private:
+        struct Mapping {
+            uint8_t *data;
+            size_t length;
+            unsigned int users;
+        };
+
+        std::map<std::pair<dev_t, ino_t>, Mapping> mappings_;
+};
@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "EventRecorder.h"
+#include "FrameStatsLog.h"
+#include "LatencyStats.h"
+#include "Trace.h"
+
+// closeAt_ while the end of the event hasn't been seen yet
+static constexpr uint64_t kOpen = UINT64_MAX;
+
+int EventRecorder::start(const std::string &folder, double preSeconds, double postSeconds, size_t arenaBytes,
+                         int quality, size_t maxFrames) {
+    stop();
+    if (mkdir(folder.c_str(), 0777) && errno != EEXIST) {
+        std::cerr << "Failed to create " << folder << ": " << strerror(errno) << std::endl;
+        return -errno;
+    }
+    folder_ = folder;
+    pre_ = preSeconds * 1e9;
+    post_ = postSeconds * 1e9;
+    // Touched now so the pages are resident before capture starts
+    arena_.reset(new uint8_t[arenaBytes]);
+    memset(arena_.get(), 0, arenaBytes);
+    arenaSize_ = arenaBytes;
+    index_.assign(std::max<size_t>(maxFrames, 1), Entry{});
+    encoder_ = std::make_unique<JpegEncoder>(quality);
+    oldest_ = next_ = 0;
+    head_ = 0;
+    active_ = false;
+    stopping_ = false;
+    events_ = written_ = dropped_ = 0;
+    writer_ = std::thread(&EventRecorder::run, this);
+    return 0;
+}
+
+void EventRecorder::stop() {
+    if (!writer_.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (active_ && closeAt_ > next_)
+            closeAt_ = next_;
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+    encoder_.reset();
+    arena_.reset();
+    index_.clear();
+}
+
+bool EventRecorder::reserve(size_t size, size_t *offset) {
+    if (size > arenaSize_)
+        return false;
+    while (true) {
+        if (oldest_ == next_) {
+            head_ = 0;
+            *offset = 0;
+            return true;
+        }
+        if (next_ - oldest_ < index_.size()) {
+            size_t tail = entry(oldest_).offset;
+            if (entry(next_ - 1).offset >= tail) {
+                // Free from head_ to the end and from the start to tail
+                if (head_ + size <= arenaSize_) {
+                    *offset = head_;
+                    return true;
+                }
+                if (size <= tail) {
+                    *offset = 0;
+                    return true;
+                }
+            } else if (head_ + size <= tail) {
+                *offset = head_;
+                return true;
+            }
+        }
+        if (pinned(oldest_))
+            return false;
+        oldest_++;
+    }
+}
+
+void EventRecorder::add(const JpegInput &input, uint32_t frameID, uint64_t timestamp) {
+    if (!encoder_)
+        return;
+    const uint8_t *jpeg = nullptr;
+    size_t size;
+    {
+        TraceSpan span("eventEncode", frameID);
+        size = encoder_->encode(input, &jpeg);
+    }
+    if (!size)
+        return;
+
+    size_t offset;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!reserve(size, &offset)) {
+            dropped_++;
+            return;
+        }
+    }
+    // Only this thread allocates, and the writer only reads frames below
+    // next_, so the copy needs no lock.
+    memcpy(arena_.get() + offset, jpeg, size);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (active_ && closeAt_ == kOpen && timestamp > end_)
+            closeAt_ = next_;
+        entry(next_) = Entry{ offset, size, frameID, timestamp };
+        head_ = offset + size;
+        next_++;
+    }
+    cv_.notify_all();
+}
+
+void EventRecorder::trigger(const std::string &reason, uint64_t timestamp) {
+    if (!timestamp)
+        timestamp = latencyClock();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!encoder_ || stopping_)
+            return;
+        end_ = std::max(active_ ? end_ : 0, timestamp + post_);
+        if (active_) {
+            // Extended, or reopened while the writer was finishing it
+            closeAt_ = kOpen;
+            return;
+        }
+        active_ = true;
+        events_++;
+        uint64_t begin = timestamp > pre_ ? timestamp - pre_ : 0;
+        writeNext_ = oldest_;
+        while (writeNext_ < next_ && entry(writeNext_).timestamp < begin)
+            writeNext_++;
+        closeAt_ = kOpen;
+        eventFrames_ = 0;
+        reason_ = reason;
+        char stamp[32];
+        time_t now = time(nullptr);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+        eventDir_ = folder_ + "/" + stamp + "_" + std::to_string(events_) + "_" + reason;
+    }
+    Trace::instant("eventTrigger");
+    cv_.notify_all();
+}
+
+void EventRecorder::run() {
+    pthread_setname_np(pthread_self(), "events");
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || (active_ && (writeNext_ < next_ || writeNext_ >= closeAt_)); });
+        if (!active_) {
+            if (stopping_)
+                return;
+            continue;
+        }
+        // Only if the event was reopened after frames past it were let go
+        writeNext_ = std::max(writeNext_, oldest_);
+        if (writeNext_ >= closeAt_) {
+            finishEvent(lock);
+            continue;
+        }
+        if (writeNext_ >= next_)
+            continue;
+        // The frame stays put until writeNext_ moves past it
+        Entry e = entry(writeNext_);
+        bool first = !eventFrames_;
+        std::string dir = eventDir_;
+        lock.unlock();
+        if (first && mkdir(dir.c_str(), 0777) && errno != EEXIST)
+            std::cerr << "Failed to create " << dir << ": " << strerror(errno) << std::endl;
+        {
+            TraceSpan span("eventWrite", e.frameID);
+            std::string filename = dir + "/" + statsFilename(e.frameID);
+            FILE *fp = fopen(filename.c_str(), "wb");
+            if (!fp || fwrite(arena_.get() + e.offset, 1, e.size, fp) != e.size)
+                std::cerr << "Failed to write " << filename << std::endl;
+            if (fp)
+                fclose(fp);
+        }
+        lock.lock();
+        writeNext_++;
+        eventFrames_++;
+        written_++;
+    }
+}
+
+void EventRecorder::finishEvent(std::unique_lock<std::mutex> &lock) {
+    std::string dir = eventDir_;
+    std::string reason = reason_;
+    uint64_t frames = eventFrames_;
+    lock.unlock();
+    if (frames) {
+        std::string filename = dir + "/event.txt";
+        FILE *fp = fopen(filename.c_str(), "w");
+        if (fp) {
+            fprintf(fp, "reason=%s\nframes=%lu\n", reason.c_str(), (unsigned long)frames);
+            fclose(fp);
+        } else {
+            std::cerr << "Failed to write " << filename << std::endl;
+        }
+        printf("Event %s: %lu frames\n", dir.c_str(), (unsigned long)frames);
+    }
+    lock.lock();
+    // A trigger meanwhile keeps the event going
+    if (writeNext_ >= closeAt_)
+        active_ = false;
+}
+
+uint64_t EventRecorder::events() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_;
+}
+
+uint64_t EventRecorder::storedFrames() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return next_ - oldest_;
+}
+
+uint64_t EventRecorder::writtenFrames() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return written_;
+}
+
+uint64_t EventRecorder::droppedFrames() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+}
+
+size_t EventRecorder::arenaUsed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (oldest_ == next_)
+        return 0;
+    size_t tail = index_[oldest_ % index_.size()].offset;
+    return head_ > tail ? head_ - tail : arenaSize_ - tail + head_;
+}
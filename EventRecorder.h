@@ -0,0 +1,97 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "JpegEncoder.h"
+
+// Keeps the last few seconds of frames as JPEGs in memory and writes them
+// out around events. Compressed frames go back to back into one arena
+// allocated (and touched) by start(), the oldest making room for the
+// newest, so memory use is fixed whatever the scene does.
+//
+// trigger() marks the frames of the last preSeconds and every frame up to
+// postSeconds after the trigger for writing; a writer thread saves them to
+// a folder of their own under the given one. A trigger during an event
+// extends it. Frames still waiting for the writer are never overwritten:
+// while the arena is full of them new frames are dropped instead, so a
+// slow disk costs frames, not capture time.
+class EventRecorder {
+    public:
+        EventRecorder(){};
+        ~EventRecorder() { stop(); }
+
+        int start(const std::string &folder, double preSeconds, double postSeconds, size_t arenaBytes,
+                  int quality = 80, size_t maxFrames = 4096);
+        // Writes out the event in progress, if any, first.
+        void stop();
+        bool running() const { return writer_.joinable(); }
+
+        // Compresses a frame into the arena. From one thread at a time;
+        // timestamp is the sensor timestamp (latencyClock()).
+        void add(const JpegInput &input, uint32_t frameID, uint64_t timestamp);
+        // From any thread. reason names the event folder; timestamp 0 is now.
+        void trigger(const std::string &reason, uint64_t timestamp = 0);
+
+        uint64_t events() const;
+        uint64_t storedFrames() const;
+        uint64_t writtenFrames() const;
+        // Frames that found the arena full of frames still to be written.
+        uint64_t droppedFrames() const;
+        size_t arenaUsed() const;
+        size_t arenaSize() const { return arenaSize_; }
+
+    private:
+        struct Entry {
+            size_t offset;
+            size_t size;
+            uint32_t frameID;
+            uint64_t timestamp;
+        };
+
+        Entry &entry(uint64_t n) { return index_[n % index_.size()]; }
+        bool pinned(uint64_t n) const { return active_ && n >= writeNext_ && n < closeAt_; }
+        // Space for size bytes at head_, evicting the oldest frames; false
+        // if that would take a frame still to be written.
+        bool reserve(size_t size, size_t *offset);
+        void run();
+        // Writes the event's summary, unlocking meanwhile.
+        void finishEvent(std::unique_lock<std::mutex> &lock);
+
+        std::string folder_;
+        uint64_t pre_ = 0;   // ns
+        uint64_t post_ = 0;  // ns
+        std::unique_ptr<uint8_t[]> arena_;
+        size_t arenaSize_ = 0;
+        std::unique_ptr<JpegEncoder> encoder_;
+
+        mutable std::mutex mutex_;
+        std::condition_variable cv_;
+        std::thread writer_;
+        bool stopping_ = false;
+        // Frames are numbered as added; [oldest_, next_) are in the arena.
+        std::vector<Entry> index_;
+        uint64_t oldest_ = 0;
+        uint64_t next_ = 0;
+        size_t head_ = 0;
+
+        // The event being written: frames [writeNext_, closeAt_) are still
+        // to go, closeAt_ being open-ended until a frame after end_ turns up.
+        bool active_ = false;
+        uint64_t writeNext_ = 0;
+        uint64_t closeAt_ = 0;
+        uint64_t end_ = 0;
+        std::string eventDir_;
+        std::string reason_;
+        uint64_t eventFrames_ = 0;
+
+        uint64_t events_ = 0;
+        uint64_t written_ = 0;
+        uint64_t dropped_ = 0;
+};
@@ -0,0 +1,24 @@
+#include "Frame.h"
+#include "Trace.h"
+
+Frame &Frame::operator=(Frame &&other) {
+    if (this != &other) {
+        release();
+        source_ = other.source_;
+        data_ = other.data_;
+        other.source_ = nullptr;
+    }
+    return *this;
+}
+
+void Frame::release() {
+    if (source_) {
+        TraceSpan span("returnFrameBuffer", data_.sequence);
+        source_->returnFrameBuffer(data_);
+    }
+    source_ = nullptr;
+}
+
+std::shared_ptr<const Frame> Frame::share() {
+    return std::make_shared<const Frame>(std::move(*this));
+}
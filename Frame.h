@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+
+#include "FrameSource.h"
+
+// Owns one frame read from a FrameSource and gives its buffer back when
+// destroyed, so a frame can't be leaked or returned twice. Move-only; use
+// share() to let several readers hold the same mapped buffer, which is then
+// requeued once the last of them lets go.
+class Frame {
+    public:
+        Frame(){};
+        Frame(FrameSource *source, const LibcameraOutData &data)
+            : source_(source), data_(data) {}
+        Frame(Frame &&other) : source_(other.source_), data_(other.data_) { other.source_ = nullptr; }
+        Frame &operator=(Frame &&other);
+        Frame(const Frame &) = delete;
+        Frame &operator=(const Frame &) = delete;
+        ~Frame() { release(); }
+
+        explicit operator bool() const { return source_ != nullptr; }
+
+        // Hands the buffer back now instead of at destruction.
+        void release();
+        std::shared_ptr<const Frame> share();
+
+        const LibcameraOutData &data() const { return data_; }
+        const StreamView &stream(unsigned int index = kMainStream) const { return data_.streams[index]; }
+        unsigned int streamCount() const { return data_.streamCount; }
+        uint8_t *imageData() const { return data_.imageData; }
+        uint32_t size() const { return data_.size; }
+
+        // Sequence number counted by the sensor; gaps mean lost frames.
+        uint64_t sequence() const { return data_.sequence; }
+        // Start of exposure in nanoseconds on latencyClock().
+        uint64_t timestamp() const { return data_.timestamp; }
+
+    private:
+        FrameSource *source_ = nullptr;
+        LibcameraOutData data_;
+};
+
+typedef std::shared_ptr<const Frame> SharedFrame;
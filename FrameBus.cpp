@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "FrameBus.h"
+
+static int unixAddress(const std::string &path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path)) {
+        std::cerr << "Frame bus socket path too long: " << path << std::endl;
+        return -EINVAL;
+    }
+    strcpy(addr->sun_path, path.c_str());
+    return 0;
+}
+
+int FrameBus::start(const std::string &path, unsigned int maxHeld) {
+    stop();
+    struct sockaddr_un addr;
+    int ret = unixAddress(path, &addr);
+    if (ret)
+        return ret;
+    // A socket left behind by an earlier run would make bind() fail;
+    // anything else there isn't ours to remove.
+    struct stat st;
+    if (!lstat(addr.sun_path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            std::cerr << "Not serving frames on " << path << ": not a socket" << std::endl;
+            return -EEXIST;
+        }
+        unlink(addr.sun_path);
+    }
+    listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    ret = listen_fd_ < 0 ? -1 : bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    if (!ret)
+        path_ = path;
+    if (!ret)
+        ret = listen(listen_fd_, 8);
+    if (ret) {
+        ret = -errno;
+        std::cerr << "Failed to serve frames on " << path << ": " << strerror(errno) << std::endl;
+        stop();
+        return ret;
+    }
+
+    maxHeld_ = std::max(maxHeld, 1u);
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    running_ = true;
+    thread_ = std::thread(&FrameBus::run, this);
+    return 0;
+}
+
+void FrameBus::stop() {
+    if (thread_.joinable()) {
+        running_ = false;
+        wake();
+        thread_.join();
+    }
+    std::vector<std::shared_ptr<const void>> released;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::unique_ptr<Subscriber> &subscriber : subscribers_)
+            close(subscriber->fd);
+        subscribers_.clear();
+        for (auto &frame : frames_)
+            released.push_back(std::move(frame.second.owner));
+        frames_.clear();
+        bufferIndex_.clear();
+    }
+    if (listen_fd_ >= 0)
+        close(listen_fd_);
+    if (wake_fd_ >= 0)
+        close(wake_fd_);
+    if (!path_.empty())
+        unlink(path_.c_str());
+    listen_fd_ = -1;
+    wake_fd_ = -1;
+    path_.clear();
+}
+
+void FrameBus::wake() {
+    uint64_t one = 1;
+    if (wake_fd_ >= 0 && write(wake_fd_, &one, sizeof(one)) < 0)
+        std::cerr << "Failed to wake frame bus" << std::endl;
+}
+
+size_t FrameBus::subscribers() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return subscribers_.size();
+}
+
+int FrameBus::sendBuffer(Subscriber &subscriber, uint32_t index, const StreamView &view) {
+    FrameBusBuffer message = {};
+    message.type = kBusBuffer;
+    message.buffer = index;
+    message.format = view.format.fourcc();
+    message.width = view.width;
+    message.height = view.height;
+    message.planeCount = view.planeCount;
+    int fds[3];
+    for (unsigned int i = 0; i < view.planeCount; i++) {
+        message.planes[i] = { view.planes[i].offset, view.planes[i].stride, view.planes[i].length };
+        fds[i] = view.planes[i].fd;
+    }
+
+    struct iovec iov = { &message, sizeof(message) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * view.planeCount);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * view.planeCount);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * view.planeCount);
+    if (sendmsg(subscriber.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        return -errno;
+    return 0;
+}
+
+void FrameBus::publish(const LibcameraOutData &data, std::shared_ptr<const void> owner) {
+    const StreamView &view = data.streams[kMainStream];
+    if (!data.streamCount || !view.planeCount || view.planes[0].fd < 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (subscribers_.empty())
+        return;
+    uint32_t index = bufferIndex_.emplace(view.planes[0].data, bufferIndex_.size()).first->second;
+    uint64_t id = nextId_++;
+    FrameBusFrame message = {};
+    message.type = kBusFrame;
+    message.buffer = index;
+    message.id = id;
+    message.sequence = data.sequence;
+    message.timestamp = data.timestamp;
+    for (unsigned int i = 0; i < view.planeCount; i++)
+        message.bytesused[i] = view.planes[i].bytesused;
+
+    unsigned int refs = 0;
+    for (std::unique_ptr<Subscriber> &subscriber : subscribers_) {
+        if (subscriber->dead)
+            continue;
+        // A full socket buffer is a slow subscriber too.
+        int ret = 0;
+        if (subscriber->held.size() >= maxHeld_) {
+            ret = -EAGAIN;
+        } else if (!subscriber->buffers.count(index)) {
+            ret = sendBuffer(*subscriber, index, view);
+            if (!ret)
+                subscriber->buffers.insert(index);
+        }
+        if (!ret && send(subscriber->fd, &message, sizeof(message), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+            ret = -errno;
+        if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+        } else if (ret) {
+            // Gone; the bus thread cleans up after it.
+            subscriber->dead = true;
+            wake();
+        } else {
+            subscriber->held.insert(id);
+            refs++;
+        }
+    }
+    if (refs) {
+        frames_[id] = Published{ std::move(owner), refs };
+        sent_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void FrameBus::release(uint64_t id, std::vector<std::shared_ptr<const void>> *released) {
+    auto it = frames_.find(id);
+    if (it == frames_.end())
+        return;
+    if (--it->second.refs == 0) {
+        released->push_back(std::move(it->second.owner));
+        frames_.erase(it);
+    }
+}
+
+void FrameBus::reset() {
+    std::vector<std::shared_ptr<const void>> released;
+    std::lock_guard<std::mutex> lock(mutex_);
+    FrameBusReset message = { kBusReset };
+    for (std::unique_ptr<Subscriber> &subscriber : subscribers_) {
+        if (!subscriber->dead && send(subscriber->fd, &message, sizeof(message), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            // A reset it doesn't get would leave it with stale buffers.
+            subscriber->dead = true;
+            wake();
+        }
+        subscriber->buffers.clear();
+        subscriber->held.clear();
+    }
+    for (auto &frame : frames_)
+        released.push_back(std::move(frame.second.owner));
+    frames_.clear();
+    bufferIndex_.clear();
+}
+
+void FrameBus::run() {
+    pthread_setname_np(pthread_self(), "framebus");
+    std::vector<struct pollfd> fds;
+    std::vector<Subscriber *> polled;
+    while (running_.load(std::memory_order_relaxed)) {
+        // Subscribers are only added and removed on this thread, so the
+        // pointers stay valid until the end of the iteration.
+        fds.assign({ { listen_fd_, POLLIN, 0 }, { wake_fd_, POLLIN, 0 } });
+        polled.clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::unique_ptr<Subscriber> &subscriber : subscribers_) {
+                fds.push_back({ subscriber->fd, POLLIN, 0 });
+                polled.push_back(subscriber.get());
+            }
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Frame bus: " << strerror(errno) << std::endl;
+            return;
+        }
+        if (fds[1].revents) {
+            uint64_t count;
+            if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                std::cerr << "Failed to read frame bus eventfd" << std::endl;
+        }
+
+        std::vector<std::shared_ptr<const void>> released;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < polled.size(); i++) {
+            if (!fds[i + 2].revents)
+                continue;
+            Subscriber &subscriber = *polled[i];
+            FrameBusRelease message;
+            ssize_t size;
+            while ((size = recv(subscriber.fd, &message, sizeof(message), MSG_DONTWAIT)) > 0) {
+                if (size == sizeof(message) && message.type == kBusRelease && subscriber.held.erase(message.id))
+                    release(message.id, &released);
+            }
+            if (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                subscriber.dead = true;
+        }
+        for (auto it = subscribers_.begin(); it != subscribers_.end();) {
+            if (!(*it)->dead) {
+                ++it;
+                continue;
+            }
+            // Whatever it still held goes back now.
+            for (uint64_t id : (*it)->held)
+                release(id, &released);
+            close((*it)->fd);
+            it = subscribers_.erase(it);
+        }
+        if (fds[0].revents) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd >= 0) {
+                subscribers_.push_back(std::make_unique<Subscriber>());
+                subscribers_.back()->fd = fd;
+            }
+        }
+    }
+}
+
+int FrameBusClient::connect(const std::string &path) {
+    close();
+    struct sockaddr_un addr;
+    int ret = unixAddress(path, &addr);
+    if (ret)
+        return ret;
+    fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        ret = -errno;
+        std::cerr << "Failed to connect to frame bus " << path << ": " << strerror(errno) << std::endl;
+        close();
+        return ret;
+    }
+    return 0;
+}
+
+void FrameBusClient::close() {
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+    buffers_.clear();
+    held_.clear();
+    mappings_.clear();
+}
+
+bool FrameBusClient::next(FrameBusView *frame, int timeout_ms) {
+    while (fd_ >= 0) {
+        struct pollfd pfd = { fd_, POLLIN, 0 };
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        // Large enough for any message.
+        union {
+            FrameBusBuffer buffer;
+            FrameBusFrame frame;
+            uint32_t type;
+        } message;
+        union {
+            char buf[CMSG_SPACE(sizeof(int) * 3)];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { &message, sizeof(message) };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t size = recvmsg(fd_, &msg, MSG_CMSG_CLOEXEC);
+        if (size <= 0) {
+            if (size < 0 && errno == EINTR)
+                continue;
+            close();
+            return false;
+        }
+        int fds[3];
+        unsigned int fdCount = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                fdCount = std::min<size_t>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), 3);
+                memcpy(fds, CMSG_DATA(cmsg), fdCount * sizeof(int));
+            }
+        }
+
+        bool received = false;
+        if (message.type == kBusBuffer && size == sizeof(FrameBusBuffer) &&
+            fdCount == message.buffer.planeCount && fdCount > 0) {
+            std::shared_ptr<Buffer> buffer = std::make_shared<Buffer>();
+            StreamView &view = buffer->view;
+            view = {};
+            view.format = PixelFormat(message.buffer.format);
+            view.width = message.buffer.width;
+            view.height = message.buffer.height;
+            view.planeCount = fdCount;
+            bool mapped = true;
+            for (unsigned int i = 0; i < fdCount; i++) {
+                const auto &plane = message.buffer.planes[i];
+                uint8_t *base = mappings_.map(fds[i], plane.offset + plane.length);
+                mapped &= base != nullptr;
+                buffer->bases[i] = base;
+                view.planes[i] = { base ? base + plane.offset : nullptr, plane.offset, plane.stride, 0,
+                                   plane.length, -1 };
+            }
+            if (mapped)
+                buffers_[message.buffer.buffer] = buffer;
+            else
+                unmap(*buffer);
+        } else if (message.type == kBusFrame && size == sizeof(FrameBusFrame)) {
+            auto it = buffers_.find(message.frame.buffer);
+            if (it == buffers_.end()) {
+                release(message.frame.id);
+            } else {
+                frame->id = message.frame.id;
+                frame->sequence = message.frame.sequence;
+                frame->timestamp = message.frame.timestamp;
+                frame->stream = it->second->view;
+                for (unsigned int i = 0; i < frame->stream.planeCount; i++)
+                    frame->stream.planes[i].bytesused = message.frame.bytesused[i];
+                it->second->held++;
+                held_[message.frame.id] = it->second;
+                received = true;
+            }
+        } else if (message.type == kBusReset) {
+            for (auto &iter : buffers_) {
+                iter.second->stale = true;
+                if (!iter.second->held)
+                    unmap(*iter.second);
+            }
+            buffers_.clear();
+        }
+        // Mapped (or useless): the mapping keeps the buffer alive.
+        for (unsigned int i = 0; i < fdCount; i++)
+            ::close(fds[i]);
+        if (received)
+            return true;
+    }
+    return false;
+}
+
+void FrameBusClient::release(uint64_t id) {
+    auto it = held_.find(id);
+    if (it != held_.end()) {
+        Buffer &buffer = *it->second;
+        if (!--buffer.held && buffer.stale)
+            unmap(buffer);
+        held_.erase(it);
+    }
+    FrameBusRelease message = { kBusRelease, 0, id };
+    if (fd_ >= 0 && send(fd_, &message, sizeof(message), MSG_NOSIGNAL) < 0)
+        std::cerr << "Failed to release frame " << id << ": " << strerror(errno) << std::endl;
+}
+
+void FrameBusClient::unmap(Buffer &buffer) {
+    for (unsigned int i = 0; i < buffer.view.planeCount; i++) {
+        if (buffer.bases[i])
+            mappings_.unmap(buffer.bases[i]);
+        buffer.bases[i] = nullptr;
+    }
+}
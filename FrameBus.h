@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DmabufCache.h"
+#include "FrameSource.h"
+
+// Shares camera frames with other local processes without copying them.
+// Subscribers connect to a SOCK_SEQPACKET Unix socket. The first time a
+// subscriber is sent a frame in a buffer it hasn't seen, the buffer's
+// layout comes with its plane fds (SCM_RIGHTS), which it maps once; after
+// that each frame is a small descriptor naming the buffer. A subscriber
+// sends kBusRelease when done, and the buffer goes back to the camera once
+// every subscriber holding it has, and the local pipeline has let go too.
+//
+// Only the main stream is shared. Messages are the structs below, native
+// byte order, one per packet.
+enum FrameBusMessage : uint32_t {
+    kBusBuffer = 1,   // FrameBusBuffer + one fd per plane
+    kBusFrame = 2,    // FrameBusFrame
+    kBusRelease = 3,  // FrameBusRelease, subscriber to bus
+    kBusReset = 4,    // FrameBusReset: forget every buffer, frames held are void
+};
+
+struct FrameBusBuffer {
+    uint32_t type;
+    uint32_t buffer;
+    uint32_t format;  // fourcc
+    uint32_t width;
+    uint32_t height;
+    uint32_t planeCount;
+    struct {
+        uint32_t offset;  // into the plane's fd
+        uint32_t stride;
+        uint32_t length;
+    } planes[3];
+};
+
+struct FrameBusFrame {
+    uint32_t type;
+    uint32_t buffer;
+    uint64_t id;
+    uint64_t sequence;
+    uint64_t timestamp;  // start of exposure, ns on CLOCK_BOOTTIME
+    uint32_t bytesused[3];
+    uint32_t reserved;
+};
+
+struct FrameBusRelease {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t id;
+};
+
+struct FrameBusReset {
+    uint32_t type;
+};
+
+static_assert(sizeof(FrameBusBuffer) == 60 && sizeof(FrameBusFrame) == 48 && sizeof(FrameBusRelease) == 16,
+              "message layouts are shared with blueintesity.py");
+
+class FrameBus {
+    public:
+        FrameBus(){};
+        ~FrameBus() { stop(); }
+
+        // Listens at path, replacing a stale socket. A subscriber holding
+        // maxHeld frames misses the next ones rather than keep more
+        // buffers from the camera. Returns 0 or -errno.
+        int start(const std::string &path, unsigned int maxHeld = 2);
+        void stop();
+
+        // Sends the frame to every subscriber with room for it. owner is
+        // kept until the last of them releases it; it should be what keeps
+        // the frame's buffer out of the camera.
+        void publish(const LibcameraOutData &data, std::shared_ptr<const void> owner);
+        // Before reconfiguring the camera: drops every frame subscribers
+        // hold and tells them to forget the buffers.
+        void reset();
+
+        size_t subscribers() const;
+        uint64_t sentFrames() const { return sent_.load(std::memory_order_relaxed); }
+        // Frames a subscriber missed because it held too many.
+        uint64_t skippedFrames() const { return skipped_.load(std::memory_order_relaxed); }
+
+    private:
+        struct Subscriber {
+            int fd;
+            bool dead = false;
+            std::set<uint32_t> buffers;  // sent already
+            std::set<uint64_t> held;     // frame ids not released yet
+        };
+        struct Published {
+            std::shared_ptr<const void> owner;
+            unsigned int refs;
+        };
+
+        void run();
+        int sendBuffer(Subscriber &subscriber, uint32_t index, const StreamView &view);
+        // Drops one reference; the owner is moved to *released rather than
+        // destroyed under the lock.
+        void release(uint64_t id, std::vector<std::shared_ptr<const void>> *released);
+        void wake();
+
+        std::string path_;
+        unsigned int maxHeld_ = 2;
+        int listen_fd_ = -1;
+        int wake_fd_ = -1;
+        std::thread thread_;
+        std::atomic<bool> running_{false};
+
+        mutable std::mutex mutex_;
+        std::vector<std::unique_ptr<Subscriber>> subscribers_;
+        std::map<const uint8_t *, uint32_t> bufferIndex_;  // by first plane
+        std::map<uint64_t, Published> frames_;
+        uint64_t nextId_ = 0;
+        std::atomic<uint64_t> sent_{0};
+        std::atomic<uint64_t> skipped_{0};
+};
+
+// The subscriber side, for C++ tools.
+struct FrameBusView {
+    uint64_t id;
+    uint64_t sequence;
+    uint64_t timestamp;
+    StreamView stream;  // planes mapped read-only; fd is -1
+};
+
+class FrameBusClient {
+    public:
+        FrameBusClient(){};
+        ~FrameBusClient() { close(); }
+
+        int connect(const std::string &path);
+        void close();
+
+        // Waits up to timeout_ms (-1 for ever) for the next frame. False on
+        // timeout or when the bus went away (then connected() is false).
+        bool next(FrameBusView *frame, int timeout_ms);
+        // Hands a frame from next() back; its planes must not be read after.
+        void release(uint64_t id);
+
+        bool connected() const { return fd_ >= 0; }
+
+    private:
+        struct Buffer {
+            StreamView view;
+            const uint8_t *bases[3];  // of the planes' mappings
+            unsigned int held = 0;
+            bool stale = false;       // from before a reset
+        };
+
+        // Drops the buffer's mappings, once no frame in it is held.
+        void unmap(Buffer &buffer);
+
+        int fd_ = -1;
+        std::map<uint32_t, std::shared_ptr<Buffer>> buffers_;
+        // Frames from next() not released yet. A reset unmaps the buffers
+        // no frame is held in and the rest as their frames are released, so
+        // those can still be read meanwhile.
+        std::map<uint64_t, std::shared_ptr<Buffer>> held_;
+        DmabufCache mappings_;
+};
@@ -0,0 +1,22 @@
+#include <algorithm>
+#include <math.h>
+
+#include "FrameRateController.h"
+
+FrameRateController::FrameRateController(double minFps, double maxFps, double targetLoad)
+    : minFps_(minFps), maxFps_(std::max(minFps, maxFps)), targetLoad_(targetLoad), fps_(maxFps_) {}
+
+bool FrameRateController::update(double stageMs, bool backlogged) {
+    double target = fps_;
+    if (stageMs > 0)
+        target = std::min(targetLoad_ * 1000 / stageMs, fps_ * 1.25);
+    if (backlogged)
+        target = std::min(target, fps_ / 2);
+    target = std::min(std::max(target, minFps_), maxFps_);
+
+    // Ignore small changes; every change costs the sensor a reprogram.
+    if (fabs(target - fps_) < fps_ * 0.05)
+        return false;
+    fps_ = target;
+    return true;
+}
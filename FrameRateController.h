@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+// Picks a sensor frame rate the pipeline can keep up with, so frames are
+// not produced only to be dropped. Call update() periodically with what
+// the limiting stage spent per frame and whether its queue was full; apply
+// frameDurationUs() as FrameDurationLimits when it returns true.
+//
+// The rate is set to targetLoad of what that stage could sustain, halved
+// while its queue is full, and raised by at most 25% a step so a brief
+// lull doesn't overshoot.
+class FrameRateController {
+    public:
+        FrameRateController(double minFps, double maxFps, double targetLoad = 0.8);
+
+        // stageMs: average time per frame of the limiting stage; 0 if no
+        // frames got through.
+        bool update(double stageMs, bool backlogged);
+
+        double fps() const { return fps_; }
+        int64_t frameDurationUs() const { return static_cast<int64_t>(1e6 / fps_); }
+
+    private:
+        double minFps_;
+        double maxFps_;
+        double targetLoad_;
+        double fps_;
+};
@@ -0,0 +1,123 @@
+#include <chrono>
+#include <errno.h>
+#include <iostream>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Frame.h"
+#include "FrameSource.h"
+#include "LatencyStats.h"
+#include "Trace.h"
+
+bool FrameSource::waitForFrame(LibcameraOutData *frameData, int event_fd, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!readFrame(frameData)) {
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0)
+                return false;
+            wait_ms = remaining.count();
+        }
+        // The eventfd counter is only cleared after a wakeup, so a completion
+        // that lands between the pop above and poll() is never missed.
+        struct pollfd pfd = { event_fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, wait_ms);
+        if (ret < 0 && errno != EINTR) {
+            std::cerr << "Failed to wait for frame: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (ret > 0) {
+            uint64_t count;
+            if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                return false;
+        }
+    }
+    return true;
+}
+
+uint32_t FrameSource::planeStride(PixelFormat format, uint32_t stride, unsigned int plane) {
+    // Planar 4:2:x formats halve the chroma rows; semi-planar NV12/NV21
+    // interleave U and V at the luma stride.
+    if (plane && (format == formats::YUV420 || format == formats::YVU420 || format == formats::YUV422))
+        return stride / 2;
+    return stride;
+}
+
+Frame FrameSource::nextFrame(int timeout_ms) {
+    // Includes the wait, so gaps between frames show up too.
+    TraceSpan span("readFrame");
+    LibcameraOutData data;
+    if (!readFrame(&data, timeout_ms))
+        return Frame();
+    span.setFrame(data.sequence);
+    return Frame(this, data);
+}
+
+void FrameSource::recordInit() {
+    initTime_ = latencyClock();
+    firstFrameNs_.store(0, std::memory_order_relaxed);
+}
+
+void FrameSource::recordDequeue(LibcameraOutData *frameData, bool usable) {
+    static LatencyHistogram &complete = LatencyStats::global().histogram("complete");
+    static LatencyHistogram &dequeue = LatencyStats::global().histogram("dequeue");
+    frameData->dequeued = latencyClock();
+    frames_.fetch_add(1, std::memory_order_relaxed);
+    // Sequence numbers start over when the camera restarts.
+    if (haveSequence_ && frameData->sequence > lastSequence_)
+        sequenceGaps_.fetch_add(frameData->sequence - lastSequence_ - 1, std::memory_order_relaxed);
+    haveSequence_ = true;
+    lastSequence_ = frameData->sequence;
+    bufferTuner_.frameDequeued(frameData->timestamp, frameData->sequence);
+    if (usable && initTime_ && !firstFrameNs_.load(std::memory_order_relaxed))
+        firstFrameNs_.store(frameData->dequeued - initTime_, std::memory_order_relaxed);
+
+    if (!frameData->timestamp)
+        return;
+    complete.record(frameData->completed - frameData->timestamp);
+    dequeue.record(frameData->dequeued - frameData->timestamp);
+}
+
+void FrameSource::recordReturn(const LibcameraOutData &frameData) {
+    static LatencyHistogram &held = LatencyStats::global().histogram("held");
+    static LatencyHistogram &returned = LatencyStats::global().histogram("return");
+    uint64_t now = latencyClock();
+    held.record(now - frameData.dequeued);
+
+    uint64_t requeue = now > frameData.completed ? now - frameData.completed : 0;
+    bufferTuner_.frameReturned(requeue);
+    requeued_.fetch_add(1, std::memory_order_relaxed);
+    requeueNs_.fetch_add(requeue, std::memory_order_relaxed);
+    uint64_t max = maxRequeueNs_.load(std::memory_order_relaxed);
+    while (requeue > max && !maxRequeueNs_.compare_exchange_weak(max, requeue, std::memory_order_relaxed))
+        ;
+
+    if (frameData.timestamp)
+        returned.record(now - frameData.timestamp);
+}
+
+CaptureStats FrameSource::captureStats() const {
+    CaptureStats stats;
+    stats.frames = frames_.load(std::memory_order_relaxed);
+    stats.sequenceGaps = sequenceGaps_.load(std::memory_order_relaxed);
+    stats.cancelled = cancelled_.load(std::memory_order_relaxed);
+    stats.emptyPolls = emptyPolls_.load(std::memory_order_relaxed);
+    stats.requeued = requeued_.load(std::memory_order_relaxed);
+    stats.avgRequeueMs = stats.requeued ? requeueNs_.load(std::memory_order_relaxed) / 1e6 / stats.requeued : 0;
+    stats.maxRequeueMs = maxRequeueNs_.load(std::memory_order_relaxed) / 1e6;
+    stats.firstFrameMs = firstFrameNs_.load(std::memory_order_relaxed) / 1e6;
+    return stats;
+}
+
+void FrameSource::resetCaptureStats() {
+    frames_.store(0, std::memory_order_relaxed);
+    sequenceGaps_.store(0, std::memory_order_relaxed);
+    cancelled_.store(0, std::memory_order_relaxed);
+    emptyPolls_.store(0, std::memory_order_relaxed);
+    requeued_.store(0, std::memory_order_relaxed);
+    requeueNs_.store(0, std::memory_order_relaxed);
+    maxRequeueNs_.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#include <libcamera/controls.h>
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#include "BufferTuner.h"
+
+using namespace libcamera;
+
+// One plane of a mapped frame buffer. data already points at the plane,
+// offset is where it starts within its dmabuf. fd is that dmabuf (or memfd),
+// owned by the source, for handing the buffer to other processes.
+struct FramePlane {
+    uint8_t *data;
+    uint32_t offset;
+    uint32_t stride;
+    uint32_t bytesused;
+    uint32_t length;
+    int fd;
+};
+
+// A stream's buffer in one completed request: RGB888 has one plane,
+// YUV420 three and NV12 two.
+struct StreamView {
+    PixelFormat format;
+    uint32_t width;
+    uint32_t height;
+    unsigned int planeCount;
+    FramePlane planes[3];
+};
+
+enum StreamIndex { kMainStream, kAnalysisStream };
+constexpr unsigned int kMaxStreams = 2;
+
+typedef struct {
+    // First plane of the main stream, as before multi-plane views.
+    uint8_t *imageData;
+    uint32_t size;
+    uint64_t request;
+    uint64_t sequence;
+    uint64_t timestamp;  // start of exposure, ns on latencyClock()
+    uint64_t completed;  // latencyClock() when the request completed
+    uint64_t dequeued;   // latencyClock() when readFrame() handed it out
+    // Every configured stream, indexed by StreamIndex. Valid as long as
+    // imageData is.
+    unsigned int streamCount;
+    StreamView streams[kMaxStreams];
+} LibcameraOutData;
+
+// Frame accounting of a source since it was created (or the last
+// resetCaptureStats()). Lost frames show up as gaps in the sensor sequence
+// numbers; a source that is short of buffers loses frames without ever
+// seeing them.
+struct CaptureStats {
+    uint64_t frames;        // handed out by readFrame()
+    uint64_t sequenceGaps;  // frames missing between those
+    uint64_t cancelled;     // requests that completed cancelled
+    uint64_t emptyPolls;    // readFrame() calls that found no frame
+    uint64_t requeued;      // buffers given back
+    double avgRequeueMs;    // request completion to returnFrameBuffer()
+    double maxRequeueMs;
+    // initCamera() to the first frame with settled exposure, 0 before
+    // there is one. Not cleared by resetCaptureStats().
+    double firstFrameMs;
+};
+
+class Frame;
+
+// Interface shared by the real camera (LibCamera) and the stand-in backends
+// in SimulatedCamera.h. A frame handed out by readFrame() stays valid until
+// it is given back with returnFrameBuffer(); at most buffercount frames can
+// be outstanding at once.
+class FrameSource {
+    public:
+        virtual ~FrameSource(){};
+
+        virtual int initCamera() = 0;
+        // A non-zero analysisWidth/analysisHeight adds a second, low
+        // resolution stream (StreamIndex kAnalysisStream) captured together
+        // with the main one, so analysis can skip the full size image.
+        virtual void configureStill(int width, int height, PixelFormat format, int buffercount, int rotation,
+                                    int analysisWidth = 0, int analysisHeight = 0,
+                                    PixelFormat analysisFormat = formats::YUV420) = 0;
+        virtual int startCamera() = 0;
+        virtual int resetCamera(int width, int height, PixelFormat format, int buffercount, int rotation) = 0;
+        virtual bool readFrame(LibcameraOutData *frameData) = 0;
+        virtual bool readFrame(LibcameraOutData *frameData, int timeout_ms) = 0;
+        virtual void returnFrameBuffer(LibcameraOutData frameData) = 0;
+        // readFrame(frameData, timeout_ms) wrapped in a Frame (see Frame.h),
+        // which returns the buffer by itself. Empty on timeout.
+        Frame nextFrame(int timeout_ms);
+
+        virtual void set(ControlList controls) = 0;
+        virtual void stopCamera() = 0;
+        virtual void closeCamera() = 0;
+
+        // Returns nullptr for sources without a libcamera stream.
+        virtual Stream *VideoStream(uint32_t *w, uint32_t *h, uint32_t *stride) const = 0;
+        // Sets *w and *h to 0 when no analysis stream is configured.
+        virtual Stream *AnalysisStream(uint32_t *w, uint32_t *h, uint32_t *stride) const = 0;
+        virtual char * getCameraId() = 0;
+        // Bytes of one buffer of every configured stream together.
+        virtual size_t bufferSize() const = 0;
+
+        CaptureStats captureStats() const;
+        void resetCaptureStats();
+
+        // Buffer count (see BufferTuner.h) that would have kept the sensor
+        // fed since the last resetBufferTuning(), within memoryBudget bytes
+        // of buffers; 0 until enough frames have been returned. Apply it
+        // with resetCamera() once every frame is back.
+        unsigned int recommendedBufferCount(size_t memoryBudget) const {
+            return bufferTuner_.recommend(bufferSize(), memoryBudget);
+        }
+        void resetBufferTuning() { bufferTuner_.reset(); }
+
+    protected:
+        // Stride of plane index given the stride of the first one.
+        static uint32_t planeStride(PixelFormat format, uint32_t stride, unsigned int plane);
+
+        // readFrame(frameData, timeout_ms) for sources that bump an eventfd
+        // each time a frame completes: retries the non-blocking readFrame()
+        // and parks in poll() in between.
+        bool waitForFrame(LibcameraOutData *frameData, int event_fd, int timeout_ms);
+
+        // Latency points (LatencyStats.h) and CaptureStats every source
+        // records: initCamera() calls recordInit() first thing. readFrame()
+        // calls recordDequeue() once sequence, timestamp and completed are
+        // filled in, with usable false while exposure is still settling, or
+        // recordEmptyPoll() when there is no frame; returnFrameBuffer()
+        // calls recordReturn().
+        void recordInit();
+        void recordDequeue(LibcameraOutData *frameData, bool usable = true);
+        void recordEmptyPoll() { emptyPolls_.fetch_add(1, std::memory_order_relaxed); }
+        void recordCancelled() { cancelled_.fetch_add(1, std::memory_order_relaxed); }
+        void recordReturn(const LibcameraOutData &frameData);
+
+    private:
+        std::atomic<uint64_t> frames_{0};
+        std::atomic<uint64_t> sequenceGaps_{0};
+        std::atomic<uint64_t> cancelled_{0};
+        std::atomic<uint64_t> emptyPolls_{0};
+        std::atomic<uint64_t> requeued_{0};
+        std::atomic<uint64_t> requeueNs_{0};
+        std::atomic<uint64_t> maxRequeueNs_{0};
+        std::atomic<uint64_t> firstFrameNs_{0};
+        BufferTuner bufferTuner_;
+        uint64_t initTime_ = 0;
+        // Only touched by the reading thread.
+        bool haveSequence_ = false;
+        uint64_t lastSequence_ = 0;
+};
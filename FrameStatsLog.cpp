@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "FrameStatsLog.h"
+
+// Columns of a block in storage order: timestamp, frame ID, one count per
+// ColorClass, pixels.
+static constexpr int kStatsColumns = 3 + kColorClasses;
+
+static size_t columnWidth(int column) {
+    return column == 0 ? sizeof(int64_t) : sizeof(uint32_t);
+}
+
+static size_t rawColumnOffset(uint32_t blockRows, int column) {
+    return column == 0 ? 0 : blockRows * (sizeof(int64_t) + (column - 1) * sizeof(uint32_t));
+}
+
+static size_t rawPayloadSize(uint32_t blockRows) {
+    return rawColumnOffset(blockRows, kStatsColumns);
+}
+
+// kStatsDelta: each row is one zigzag varint per column, in column order,
+// coded against the previous row of the same block (see FrameStatsLog.h).
+static void putVarint(std::vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// The value row i's column is coded against, given the decoded rows before
+// it. Arithmetic wraps, so any input round-trips.
+static int64_t predict(const uint8_t *columns, uint32_t blockRows, int column, uint32_t i) {
+    if (column == 0) {
+        const int64_t *ts = reinterpret_cast<const int64_t *>(columns);
+        if (i < 2)
+            return i ? ts[0] : 0;
+        // Same frame interval as last time.
+        return static_cast<int64_t>(2 * static_cast<uint64_t>(ts[i - 1]) - static_cast<uint64_t>(ts[i - 2]));
+    }
+    const uint32_t *col = reinterpret_cast<const uint32_t *>(columns + rawColumnOffset(blockRows, column));
+    if (column == 1)
+        return i ? static_cast<int64_t>(col[i - 1]) + 1 : 0;
+    return i ? col[i - 1] : 0;
+}
+
+static void encodeDeltaRow(const uint8_t *columns, uint32_t blockRows, uint32_t i, std::vector<uint8_t> &out) {
+    putVarint(out, zigzag(static_cast<int64_t>(static_cast<uint64_t>(reinterpret_cast<const int64_t *>(columns)[i]) -
+                                               static_cast<uint64_t>(predict(columns, blockRows, 0, i)))));
+    for (int column = 1; column < kStatsColumns; column++) {
+        uint32_t value = reinterpret_cast<const uint32_t *>(columns + rawColumnOffset(blockRows, column))[i];
+        putVarint(out, zigzag(static_cast<int64_t>(value) - predict(columns, blockRows, column, i)));
+    }
+}
+
+// Decodes rows of a kStatsDelta payload into raw column layout. Fails on
+// truncated or corrupt input.
+static bool decodeDelta(const uint8_t *p, size_t size, uint32_t rows, uint32_t blockRows, uint8_t *columns) {
+    const uint8_t *end = p + size;
+    if (rows > blockRows)
+        return false;
+    for (uint32_t i = 0; i < rows; i++) {
+        uint64_t value;
+        if (!getVarint(p, end, &value))
+            return false;
+        reinterpret_cast<int64_t *>(columns)[i] = static_cast<int64_t>(
+            static_cast<uint64_t>(predict(columns, blockRows, 0, i)) + static_cast<uint64_t>(unzigzag(value)));
+        for (int column = 1; column < kStatsColumns; column++) {
+            if (!getVarint(p, end, &value))
+                return false;
+            reinterpret_cast<uint32_t *>(columns + rawColumnOffset(blockRows, column))[i] =
+                static_cast<uint32_t>(predict(columns, blockRows, column, i) + unzigzag(value));
+        }
+    }
+    return true;
+}
+
+static bool validHeader(const StatsFileHeader &header) {
+    return !memcmp(header.magic, kStatsMagic, sizeof(kStatsMagic)) && header.version == kStatsVersion &&
+           header.colorClasses == kColorClasses && header.blockRows > 0 &&
+           header.headerSize >= sizeof(StatsFileHeader);
+}
+
+std::string statsFilename(uint32_t frameID) {
+    return "frame_" + std::to_string(frameID) + ".jpg";
+}
+
+int FrameStatsWriter::open(const std::string &path, uint32_t blockRows, uint32_t flushRows, bool compress) {
+    close();
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+        return -errno;
+    }
+    flushRows_ = std::max(flushRows, 1u);
+    compress_ = compress;
+    rows_ = 0;
+
+    struct stat st;
+    fstat(fd_, &st);
+    StatsFileHeader file;
+    if (st.st_size == 0) {
+        memset(&file, 0, sizeof(file));
+        memcpy(file.magic, kStatsMagic, sizeof(kStatsMagic));
+        file.version = kStatsVersion;
+        file.headerSize = sizeof(file);
+        file.blockRows = blockRows;
+        file.colorClasses = kColorClasses;
+        if (pwrite(fd_, &file, sizeof(file), 0) != sizeof(file)) {
+            std::cerr << "Failed to write " << path << std::endl;
+            close();
+            return -EIO;
+        }
+        blockRows_ = blockRows;
+        blockOffset_ = sizeof(file);
+        startBlock();
+        return 0;
+    }
+
+    if (pread(fd_, &file, sizeof(file), 0) != sizeof(file) || !validHeader(file)) {
+        std::cerr << path << " is not a version " << kStatsVersion << " frame statistics log" << std::endl;
+        close();
+        return -EINVAL;
+    }
+    blockRows_ = file.blockRows;
+
+    // Find the last complete block; anything after it is a torn write.
+    uint64_t offset = file.headerSize;
+    uint64_t last = 0;
+    StatsBlockHeader header;
+    while (offset + sizeof(header) <= static_cast<uint64_t>(st.st_size)) {
+        if (pread(fd_, &header, sizeof(header), offset) != sizeof(header) || header.magic != kStatsBlockMagic ||
+            offset + sizeof(header) + header.payloadSize > static_cast<uint64_t>(st.st_size))
+            break;
+        rows_ += header.rows;
+        last = offset;
+        offset += sizeof(header) + header.payloadSize;
+    }
+
+    if (last) {
+        StatsBlockHeader tail;
+        if (pread(fd_, &tail, sizeof(tail), last) == sizeof(tail) && tail.rows < blockRows_) {
+            // Keep filling the partial block at the end of the file, in
+            // whatever encoding it was started with.
+            header_ = tail;
+            block_.assign(rawPayloadSize(blockRows_), 0);
+            delta_.clear();
+            bool ok = false;
+            if (tail.encoding == kStatsRaw) {
+                ok = pread(fd_, block_.data(), block_.size(), last + sizeof(tail)) == static_cast<ssize_t>(block_.size());
+            } else if (tail.encoding == kStatsDelta) {
+                delta_.resize(tail.payloadSize);
+                ok = pread(fd_, delta_.data(), delta_.size(), last + sizeof(tail)) == static_cast<ssize_t>(delta_.size()) &&
+                     decodeDelta(delta_.data(), delta_.size(), tail.rows, blockRows_, block_.data());
+            }
+            if (ok) {
+                blockOffset_ = last;
+                flushed_ = tail.rows;
+                flushedBytes_ = delta_.size();
+                return 0;
+            }
+            // Unreadable tail: start over after it.
+        }
+    }
+    blockOffset_ = offset;
+    startBlock();
+    return 0;
+}
+
+void FrameStatsWriter::startBlock() {
+    memset(&header_, 0, sizeof(header_));
+    header_.magic = kStatsBlockMagic;
+    header_.encoding = compress_ ? kStatsDelta : kStatsRaw;
+    header_.payloadSize = compress_ ? 0 : rawPayloadSize(blockRows_);
+    header_.minTimestamp = std::numeric_limits<int64_t>::max();
+    header_.maxTimestamp = std::numeric_limits<int64_t>::min();
+    // Raw columns are kept either way; delta coding reads the previous rows.
+    block_.assign(rawPayloadSize(blockRows_), 0);
+    delta_.clear();
+    flushed_ = 0;
+    flushedBytes_ = 0;
+
+    // Size a raw block up front so readers always see whole blocks; the
+    // columns are filled in as rows arrive. A delta block grows with its
+    // payload, and this also drops anything torn after the header.
+    if (ftruncate(fd_, blockOffset_ + sizeof(header_) + header_.payloadSize) < 0 ||
+        pwrite(fd_, &header_, sizeof(header_), blockOffset_) != sizeof(header_))
+        std::cerr << "Failed to extend frame statistics log: " << strerror(errno) << std::endl;
+}
+
+int FrameStatsWriter::append(const FrameStats &row) {
+    if (fd_ < 0)
+        return -EBADF;
+    if (header_.rows == blockRows_) {
+        blockOffset_ += sizeof(header_) + header_.payloadSize;
+        startBlock();
+    }
+
+    uint32_t i = header_.rows;
+    uint8_t *base = block_.data();
+    reinterpret_cast<int64_t *>(base)[i] = row.timestamp;
+    reinterpret_cast<uint32_t *>(base + rawColumnOffset(blockRows_, 1))[i] = row.frameID;
+    for (int c = 0; c < kColorClasses; c++)
+        reinterpret_cast<uint32_t *>(base + rawColumnOffset(blockRows_, 2 + c))[i] = row.counts[c];
+    reinterpret_cast<uint32_t *>(base + rawColumnOffset(blockRows_, 2 + kColorClasses))[i] = row.pixels;
+
+    if (!header_.rows)
+        header_.firstFrameID = row.frameID;
+    header_.lastFrameID = row.frameID;
+    header_.minTimestamp = std::min(header_.minTimestamp, row.timestamp);
+    header_.maxTimestamp = std::max(header_.maxTimestamp, row.timestamp);
+    if (header_.encoding == kStatsDelta) {
+        encodeDeltaRow(base, blockRows_, i, delta_);
+        // Keep the next block header aligned.
+        if (i + 1 == blockRows_)
+            delta_.resize((delta_.size() + 7) & ~static_cast<size_t>(7), 0);
+        header_.payloadSize = delta_.size();
+    }
+    header_.rows++;
+    rows_++;
+
+    if (header_.rows == blockRows_ || header_.rows - flushed_ >= flushRows_)
+        return flush();
+    return 0;
+}
+
+int FrameStatsWriter::flushDelta() {
+    // Append-only: just the bytes since the last flush, then the header.
+    size_t bytes = delta_.size() - flushedBytes_;
+    uint64_t payload = blockOffset_ + sizeof(header_);
+    if (pwrite(fd_, delta_.data() + flushedBytes_, bytes, payload + flushedBytes_) != static_cast<ssize_t>(bytes) ||
+        pwrite(fd_, &header_, sizeof(header_), blockOffset_) != sizeof(header_))
+        return -EIO;
+    flushedBytes_ = delta_.size();
+    flushed_ = header_.rows;
+    return 0;
+}
+
+int FrameStatsWriter::flush() {
+    if (fd_ < 0 || flushed_ == header_.rows)
+        return 0;
+    if (header_.encoding == kStatsDelta)
+        return flushDelta();
+    // Only the new end of each column is written, then the header that
+    // makes those rows visible.
+    uint64_t payload = blockOffset_ + sizeof(header_);
+    for (int column = 0; column < kStatsColumns; column++) {
+        size_t width = columnWidth(column);
+        size_t offset = rawColumnOffset(blockRows_, column) + flushed_ * width;
+        size_t bytes = (header_.rows - flushed_) * width;
+        if (pwrite(fd_, block_.data() + offset, bytes, payload + offset) != static_cast<ssize_t>(bytes))
+            return -EIO;
+    }
+    if (pwrite(fd_, &header_, sizeof(header_), blockOffset_) != sizeof(header_))
+        return -EIO;
+    flushed_ = header_.rows;
+    return 0;
+}
+
+void FrameStatsWriter::close() {
+    if (fd_ < 0)
+        return;
+    if (flush())
+        std::cerr << "Failed to write frame statistics: " << strerror(errno) << std::endl;
+    ::close(fd_);
+    fd_ = -1;
+}
+
+int FrameStatsLog::open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+        return -errno;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size < static_cast<off_t>(sizeof(StatsFileHeader))) {
+        ::close(fd);
+        std::cerr << path << " is not a frame statistics log" << std::endl;
+        return -EINVAL;
+    }
+    void *memory = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        std::cerr << "Failed to map " << path << std::endl;
+        return -ENOMEM;
+    }
+    data_ = static_cast<uint8_t *>(memory);
+    size_ = st.st_size;
+
+    const StatsFileHeader *file = reinterpret_cast<const StatsFileHeader *>(data_);
+    if (!validHeader(*file)) {
+        std::cerr << path << " is not a version " << kStatsVersion << " frame statistics log" << std::endl;
+        close();
+        return -EINVAL;
+    }
+    blockRows_ = file->blockRows;
+
+    size_t offset = file->headerSize;
+    while (offset + sizeof(StatsBlockHeader) <= size_) {
+        const StatsBlockHeader *header = reinterpret_cast<const StatsBlockHeader *>(data_ + offset);
+        if (header->magic != kStatsBlockMagic || offset + sizeof(*header) + header->payloadSize > size_)
+            break;
+        if (header->encoding != kStatsRaw && header->encoding != kStatsDelta) {
+            std::cerr << path << ": unknown block encoding " << header->encoding << std::endl;
+            break;
+        }
+        // block() reads whole columns of a raw block in place
+        if (header->rows > blockRows_ ||
+            (header->encoding == kStatsRaw && header->payloadSize != rawPayloadSize(blockRows_))) {
+            std::cerr << path << ": corrupt block at offset " << offset << std::endl;
+            break;
+        }
+        blocks_.push_back(header);
+        rows_ += header->rows;
+        offset += sizeof(*header) + header->payloadSize;
+    }
+    return 0;
+}
+
+void FrameStatsLog::close() {
+    if (data_)
+        munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+    blocks_.clear();
+    decoded_.clear();
+    rows_ = 0;
+}
+
+FrameStatsLog::BlockView FrameStatsLog::block(size_t index) const {
+    const StatsBlockHeader *header = blocks_[index];
+    const uint8_t *base = reinterpret_cast<const uint8_t *>(header + 1);
+    BlockView view;
+    view.rows = header->rows;
+    if (header->encoding == kStatsDelta) {
+        decoded_.resize(rawPayloadSize(blockRows_));
+        if (!decodeDelta(base, header->payloadSize, header->rows, blockRows_, decoded_.data())) {
+            std::cerr << "Corrupt frame statistics block " << index << std::endl;
+            view.rows = 0;
+        }
+        base = decoded_.data();
+    }
+    view.minTimestamp = header->minTimestamp;
+    view.maxTimestamp = header->maxTimestamp;
+    view.timestamp = reinterpret_cast<const int64_t *>(base);
+    view.frameID = reinterpret_cast<const uint32_t *>(base + rawColumnOffset(blockRows_, 1));
+    for (int c = 0; c < kColorClasses; c++)
+        view.counts[c] = reinterpret_cast<const uint32_t *>(base + rawColumnOffset(blockRows_, 2 + c));
+    view.pixels = reinterpret_cast<const uint32_t *>(base + rawColumnOffset(blockRows_, 2 + kColorClasses));
+    return view;
+}
+
+FrameStats FrameStatsLog::row(const BlockView &block, uint32_t index) const {
+    FrameStats row;
+    row.frameID = block.frameID[index];
+    row.timestamp = block.timestamp[index];
+    for (int c = 0; c < kColorClasses; c++)
+        row.counts[c] = block.counts[c][index];
+    row.pixels = block.pixels[index];
+    return row;
+}
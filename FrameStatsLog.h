@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ColorClassifier.h"
+
+// On-disk log of per-frame colour statistics, written by libcamera-demo
+// and read by readbin and frame.
+//
+// Layout: a FileHeader, then blocks back to back. A block is a BlockHeader
+// followed by its payload in one of two encodings:
+//
+//  - kStatsRaw: rows stored column by column (timestamps, frame IDs, one
+//    column per ColorClass, analysed pixel count), each column blockRows
+//    entries long whether or not the block is full.
+//  - kStatsDelta: rows one after the other, every field as a zigzag varint
+//    of its difference from the previous row of the block; timestamps as
+//    the change in frame interval, frame IDs as the step minus one. Steady
+//    capture packs into about a byte per field. The first row is coded
+//    against zeros, so every block decodes on its own. Payloads are padded
+//    to 8 bytes once the block is full.
+//
+// Block headers carry the block's time range, so they double as a sparse
+// time index and a reader can skip blocks without touching their payload.
+// Only the last block of a file may be partially filled, and encodings
+// can be mixed within a file.
+//
+// All fields are little endian. Readers reject files with a different
+// version.
+
+constexpr char kStatsMagic[8] = { 'F', 'S', 'T', 'A', 'T', 'L', 'O', 'G' };
+constexpr uint32_t kStatsVersion = 1;
+constexpr uint32_t kStatsBlockMagic = 0x314b4c42; // "BLK1"
+
+enum StatsEncoding { kStatsRaw = 0, kStatsDelta = 1 };
+
+struct StatsFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;   // offset of the first block
+    uint32_t blockRows;    // column length of every block
+    uint32_t colorClasses; // number of count columns
+    uint8_t reserved[40];
+};
+static_assert(sizeof(StatsFileHeader) == 64, "StatsFileHeader must stay 64 bytes");
+
+struct StatsBlockHeader {
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t encoding;     // StatsEncoding
+    uint32_t payloadSize;  // bytes of payload following the header
+    int64_t minTimestamp;
+    int64_t maxTimestamp;
+    uint32_t firstFrameID;
+    uint32_t lastFrameID;
+    uint8_t reserved[24];
+};
+static_assert(sizeof(StatsBlockHeader) == 64, "StatsBlockHeader must stay 64 bytes");
+
+// One row of the log.
+struct FrameStats {
+    uint32_t frameID;
+    int64_t timestamp;     // wall clock, microseconds since the epoch
+    uint32_t counts[kColorClasses];
+    uint32_t pixels;       // pixels analysed, for percentages
+};
+
+// JPEG name a frame is saved under; not stored in the log.
+std::string statsFilename(uint32_t frameID);
+
+// Appends rows to a log file. Rows are buffered per block and the new part
+// of every column is written out by flush(), which append() calls every
+// flushRows rows, so a crash loses at most that many rows. With compress,
+// new blocks use kStatsDelta and a flush only writes the bytes added since
+// the last one.
+class FrameStatsWriter {
+    public:
+        FrameStatsWriter(){};
+        ~FrameStatsWriter() { close(); }
+
+        // Continues an existing log (with the same layout) or creates one.
+        int open(const std::string &path, uint32_t blockRows = 4096, uint32_t flushRows = 64,
+                 bool compress = false);
+        int append(const FrameStats &row);
+        int flush();
+        void close();
+
+        uint64_t rows() const { return rows_; }
+
+    private:
+        void startBlock();
+        int flushDelta();
+
+        int fd_ = -1;
+        uint32_t blockRows_ = 0;
+        uint32_t flushRows_ = 0;
+        bool compress_ = false;
+        uint64_t blockOffset_ = 0;   // file offset of the current block
+        StatsBlockHeader header_;
+        std::vector<uint8_t> block_; // current block's columns
+        std::vector<uint8_t> delta_; // current block's kStatsDelta payload
+        uint32_t flushed_ = 0;       // rows of the current block on disk
+        size_t flushedBytes_ = 0;    // bytes of delta_ on disk
+        uint64_t rows_ = 0;
+};
+
+// Read-only view of a log. The file is mapped, not parsed: open() only
+// walks the block headers, and for raw blocks BlockView points straight
+// into the mapping. kStatsDelta blocks are decoded on demand into a buffer
+// owned by the log, valid until the next block() call.
+class FrameStatsLog {
+    public:
+        struct BlockView {
+            uint32_t rows;
+            int64_t minTimestamp;
+            int64_t maxTimestamp;
+            const int64_t *timestamp;
+            const uint32_t *frameID;
+            const uint32_t *counts[kColorClasses];
+            const uint32_t *pixels;
+        };
+
+        FrameStatsLog(){};
+        ~FrameStatsLog() { close(); }
+
+        int open(const std::string &path);
+        void close();
+
+        size_t blockCount() const { return blocks_.size(); }
+        uint64_t rows() const { return rows_; }
+        const StatsBlockHeader &blockHeader(size_t index) const { return *blocks_[index]; }
+        BlockView block(size_t index) const;
+        // Gathers one row; for printing, scans should use block().
+        FrameStats row(const BlockView &block, uint32_t index) const;
+
+    private:
+        uint8_t *data_ = nullptr;
+        size_t size_ = 0;
+        uint32_t blockRows_ = 0;
+        std::vector<const StatsBlockHeader *> blocks_;
+        mutable std::vector<uint8_t> decoded_;
+        uint64_t rows_ = 0;
+};
@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <jpeglib.h>
+
+#include "JpegEncoder.h"
+#include "Trace.h"
+
+JpegInput JpegInput::fromFrame(const uint8_t *data, PixelFormat format, uint32_t width, uint32_t height, uint32_t stride) {
+    JpegInput input = { format, width, height, { data, nullptr, nullptr }, { stride, 0, 0 } };
+    if (format == formats::YUV420) {
+        input.planes[1] = data + stride * height;
+        input.planes[2] = input.planes[1] + (stride / 2) * (height / 2);
+        input.strides[1] = input.strides[2] = stride / 2;
+    }
+    return input;
+}
+
+// libjpeg reports errors through error_exit, which must not return; jump
+// back into encode() instead of letting the default handler exit().
+struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+    JpegErrorManager *err = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    std::cerr << "JPEG encode failed: " << message << std::endl;
+    longjmp(err->jump, 1);
+}
+
+// Destination manager writing into a std::vector that is reused (and only
+// ever grows) across frames.
+struct VectorDestination {
+    struct jpeg_destination_mgr pub;
+    std::vector<uint8_t> *buffer;
+};
+
+static void initDestination(j_compress_ptr cinfo) {
+    VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+    if (dest->buffer->size() < 65536)
+        dest->buffer->resize(65536);
+    dest->pub.next_output_byte = dest->buffer->data();
+    dest->pub.free_in_buffer = dest->buffer->size();
+}
+
+static boolean emptyOutputBuffer(j_compress_ptr cinfo) {
+    VectorDestination *dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+    size_t used = dest->buffer->size();
+    dest->buffer->resize(used * 2);
+    dest->pub.next_output_byte = dest->buffer->data() + used;
+    dest->pub.free_in_buffer = dest->buffer->size() - used;
+    return TRUE;
+}
+
+static void termDestination(j_compress_ptr) {
+}
+
+struct JpegEncoder::State {
+    struct jpeg_compress_struct cinfo;
+    JpegErrorManager err;
+    VectorDestination dest;
+};
+
+JpegEncoder::JpegEncoder(int quality)
+    : state_(new State()), quality_(quality) {
+    state_->cinfo.err = jpeg_std_error(&state_->err.pub);
+    state_->err.pub.error_exit = jpegErrorExit;
+    jpeg_create_compress(&state_->cinfo);
+
+    state_->dest.pub.init_destination = initDestination;
+    state_->dest.pub.empty_output_buffer = emptyOutputBuffer;
+    state_->dest.pub.term_destination = termDestination;
+    state_->dest.buffer = &output_;
+    state_->cinfo.dest = &state_->dest.pub;
+}
+
+JpegEncoder::~JpegEncoder() {
+    jpeg_destroy_compress(&state_->cinfo);
+    delete state_;
+}
+
+size_t JpegEncoder::encode(const JpegInput &input, const uint8_t **jpeg) {
+    struct jpeg_compress_struct &cinfo = state_->cinfo;
+    bool yuv = input.format == formats::YUV420;
+    if (!yuv && input.format != formats::RGB888) {
+        std::cerr << "JPEG encoder can't take " << input.format.toString() << std::endl;
+        return 0;
+    }
+
+    if (setjmp(state_->err.jump)) {
+        jpeg_abort_compress(&cinfo);
+        return 0;
+    }
+
+    cinfo.image_width = input.width;
+    cinfo.image_height = input.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = yuv ? JCS_YCbCr : JCS_EXT_BGR;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality_, TRUE);
+
+    if (yuv) {
+        // Feed the planes as they are instead of having libjpeg resample.
+        cinfo.raw_data_in = TRUE;
+        cinfo.comp_info[0].h_samp_factor = 2;
+        cinfo.comp_info[0].v_samp_factor = 2;
+        cinfo.comp_info[1].h_samp_factor = cinfo.comp_info[2].h_samp_factor = 1;
+        cinfo.comp_info[1].v_samp_factor = cinfo.comp_info[2].v_samp_factor = 1;
+#if JPEG_LIB_VERSION >= 70
+        cinfo.do_fancy_downsampling = FALSE;
+#endif
+    }
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    if (yuv) {
+        // An MCU row is 16 luma rows and 8 chroma rows; past the bottom
+        // of the image the last row is repeated. libjpeg reads the rows
+        // out to a whole number of MCUs, so those whose stride stops short
+        // of that are copied out and padded with their last pixel.
+        JSAMPROW y_rows[16], u_rows[8], v_rows[8];
+        JSAMPARRAY planes[3] = { y_rows, u_rows, v_rows };
+        uint32_t chroma_height = (input.height + 1) / 2;
+        uint32_t widths[3] = { input.width, (input.width + 1) / 2, (input.width + 1) / 2 };
+        uint32_t mcu_width = (input.width + 15) & ~15u;
+        uint32_t padded[3] = { mcu_width, mcu_width / 2, mcu_width / 2 };
+        bool pad[3];
+        for (int c = 0; c < 3; c++)
+            pad[c] = input.strides[c] < padded[c];
+        if (pad[0] || pad[1] || pad[2])
+            padded_.resize(16 * padded[0] + 16 * padded[1]);
+        auto row = [&](int c, uint32_t y, int slot) {
+            const uint8_t *src = input.planes[c] + y * input.strides[c];
+            if (!pad[c])
+                return const_cast<JSAMPROW>(src);
+            uint8_t *dst = padded_.data() + (c ? 16 * padded[0] + (c - 1) * 8 * padded[1] : 0) + slot * padded[c];
+            memcpy(dst, src, widths[c]);
+            memset(dst + widths[c], src[widths[c] - 1], padded[c] - widths[c]);
+            return static_cast<JSAMPROW>(dst);
+        };
+        while (cinfo.next_scanline < cinfo.image_height) {
+            uint32_t line = cinfo.next_scanline;
+            for (int i = 0; i < 16; i++)
+                y_rows[i] = row(0, std::min(line + i, input.height - 1), i);
+            for (int i = 0; i < 8; i++) {
+                uint32_t y = std::min(line / 2 + i, chroma_height - 1);
+                u_rows[i] = row(1, y, i);
+                v_rows[i] = row(2, y, i);
+            }
+            jpeg_write_raw_data(&cinfo, planes, 16);
+        }
+    } else {
+        while (cinfo.next_scanline < cinfo.image_height) {
+            JSAMPROW row = const_cast<JSAMPROW>(input.planes[0] + cinfo.next_scanline * input.strides[0]);
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+    }
+
+    jpeg_finish_compress(&cinfo);
+    *jpeg = output_.data();
+    return output_.size() - state_->dest.pub.free_in_buffer;
+}
+
+JpegEncoderPool::JpegEncoderPool(unsigned int threads, int quality, size_t maxQueued)
+    : maxQueued_(std::max<size_t>(maxQueued, 1)), quality_(quality) {
+    for (unsigned int i = 0; i < std::max(threads, 1u); i++)
+        threads_.emplace_back(&JpegEncoderPool::run, this);
+}
+
+JpegEncoderPool::~JpegEncoderPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread &thread : threads_)
+        thread.join();
+}
+
+void JpegEncoderPool::submit(const JpegInput &input, const std::string &filename, Callback done) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_cv_.wait(lock, [this] { return jobs_.size() < maxQueued_; });
+    jobs_.push_back({ input, filename, std::move(done) });
+    lock.unlock();
+    work_cv_.notify_one();
+}
+
+void JpegEncoderPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this] { return jobs_.empty() && !busy_; });
+}
+
+size_t JpegEncoderPool::backlog() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return jobs_.size() + busy_;
+}
+
+uint64_t JpegEncoderPool::encodedFrames() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return encoded_;
+}
+
+double JpegEncoderPool::averageEncodeMs() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return encoded_ ? total_ms_ / encoded_ : 0;
+}
+
+double JpegEncoderPool::maxEncodeMs() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return max_ms_;
+}
+
+void JpegEncoderPool::run() {
+    pthread_setname_np(pthread_self(), "jpeg");
+    JpegEncoder encoder(quality_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        work_cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty())
+            return;
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        busy_++;
+        lock.unlock();
+        space_cv_.notify_one();
+
+        auto start = std::chrono::steady_clock::now();
+        const uint8_t *jpeg = nullptr;
+        size_t size;
+        {
+            TraceSpan span("jpegEncode");
+            size = encoder.encode(job.input, &jpeg);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        JpegResult result = { size > 0, jpeg, size, ms };
+        if (job.done) {
+            job.done(result);
+            // Drop whatever the callback holds before the file write
+            job.done = nullptr;
+        }
+
+        if (size && !job.filename.empty()) {
+            TraceSpan span("jpegWrite");
+            FILE *fp = fopen(job.filename.c_str(), "wb");
+            if (!fp || fwrite(jpeg, 1, size, fp) != size)
+                std::cerr << "Failed to write " << job.filename << std::endl;
+            if (fp)
+                fclose(fp);
+        }
+
+        lock.lock();
+        if (size) {
+            encoded_++;
+            total_ms_ += ms;
+            max_ms_ = std::max(max_ms_, ms);
+        }
+        busy_--;
+        if (jobs_.empty() && !busy_)
+            idle_cv_.notify_all();
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+using namespace libcamera;
+
+// Where the pixels to encode live, typically straight in a mapped camera
+// buffer. formats::RGB888 (B, G, R byte order) uses planes[0] only;
+// formats::YUV420 uses all three planes.
+struct JpegInput {
+    PixelFormat format;
+    uint32_t width;
+    uint32_t height;
+    const uint8_t *planes[3];
+    uint32_t strides[3];
+
+    // Describes a frame stored as one block with planes back to back
+    // (chroma stride half the luma stride for YUV420).
+    static JpegInput fromFrame(const uint8_t *data, PixelFormat format, uint32_t width, uint32_t height, uint32_t stride);
+};
+
+// One libjpeg(-turbo) compressor. The compressor state and the output
+// buffer are kept between frames, so steady-state encoding allocates
+// nothing. Not thread safe; JpegEncoderPool gives each worker its own.
+class JpegEncoder {
+    public:
+        JpegEncoder(int quality = 90);
+        ~JpegEncoder();
+
+        // Returns the JPEG size, or 0 on failure. *jpeg points into the
+        // encoder's buffer and stays valid until the next encode().
+        size_t encode(const JpegInput &input, const uint8_t **jpeg);
+
+    private:
+        struct State;
+        State *state_;
+        int quality_;
+        std::vector<uint8_t> output_;
+        // One MCU row of planes padded out to whole MCUs, for YUV420 rows
+        // whose stride stops short of that
+        std::vector<uint8_t> padded_;
+};
+
+struct JpegResult {
+    bool ok;
+    const uint8_t *data;  // only valid inside the callback
+    size_t size;
+    double encode_ms;
+};
+
+// Runs JPEG encodes on a set of worker threads. Each job's callback runs on
+// the worker as soon as compression is done, before the optional file write,
+// so the input (e.g. a camera buffer) can be handed back straight away.
+// submit() blocks while maxQueued jobs are already waiting.
+class JpegEncoderPool {
+    public:
+        typedef std::function<void(const JpegResult &)> Callback;
+
+        JpegEncoderPool(unsigned int threads = 2, int quality = 90, size_t maxQueued = 4);
+        ~JpegEncoderPool();
+
+        // filename may be empty to skip writing the result to disk.
+        void submit(const JpegInput &input, const std::string &filename, Callback done);
+        // Blocks until every submitted job has finished.
+        void wait();
+
+        // Jobs waiting or being encoded.
+        size_t backlog() const;
+        uint64_t encodedFrames() const;
+        double averageEncodeMs() const;
+        double maxEncodeMs() const;
+
+    private:
+        struct Job {
+            JpegInput input;
+            std::string filename;
+            Callback done;
+        };
+
+        void run();
+
+        size_t maxQueued_;
+        int quality_;
+        std::deque<Job> jobs_;
+        unsigned int busy_ = 0;
+        bool stopping_ = false;
+        mutable std::mutex mutex_;
+        std::condition_variable work_cv_;
+        std::condition_variable space_cv_;
+        std::condition_variable idle_cv_;
+        std::vector<std::thread> threads_;
+
+        uint64_t encoded_ = 0;
+        double total_ms_ = 0;
+        double max_ms_ = 0;
+};
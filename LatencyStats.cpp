@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "LatencyStats.h"
+
+uint64_t latencyClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int LatencyHistogram::bucket(uint64_t value) {
+    if (value < (1u << kSubBits))
+        return value;
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - kSubBits)) & ((1u << kSubBits) - 1);
+    return ((exponent - kSubBits + 1) << kSubBits) | sub;
+}
+
+uint64_t LatencyHistogram::bucketTop(int index) {
+    if (index < (1 << kSubBits))
+        return index;
+    int exponent = (index >> kSubBits) + kSubBits - 1;
+    uint64_t sub = index & ((1u << kSubBits) - 1);
+    int shift = exponent - kSubBits;
+    return ((((1u << kSubBits) + sub) << shift) - 1) + (1ull << shift);
+}
+
+void LatencyHistogram::record(int64_t ns) {
+    uint64_t value = ns > 0 ? ns : 0;
+    buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    int64_t max = max_.load(std::memory_order_relaxed);
+    while (static_cast<int64_t>(value) > max &&
+           !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        ;
+}
+
+void LatencyHistogram::reset() {
+    for (std::atomic<uint64_t> &b : buckets_)
+        b.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    uint64_t n = count();
+    return n ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / n : 0;
+}
+
+int64_t LatencyHistogram::percentile(double p) const {
+    // Buckets may be a few records ahead of count_ while others record;
+    // that only shifts the answer within the histogram's resolution.
+    uint64_t n = count();
+    if (!n)
+        return 0;
+    uint64_t target = std::max<uint64_t>(1, ceil(n * std::min(p, 100.0) / 100));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return std::min<uint64_t>(bucketTop(i), max());
+    }
+    return max();
+}
+
+LatencyStats &LatencyStats::global() {
+    static LatencyStats stats;
+    return stats;
+}
+
+LatencyHistogram &LatencyStats::histogram(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &h : histograms_) {
+        if (h.first == name)
+            return *h.second;
+    }
+    histograms_.emplace_back(name, std::make_unique<LatencyHistogram>());
+    return *histograms_.back().second;
+}
+
+void LatencyStats::print(FILE *fp) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fprintf(fp, "  %-16s %8s %9s %9s %9s %9s %9s  (ms)\n", "latency", "count", "mean", "p50", "p90", "p99", "max");
+    for (const auto &h : histograms_) {
+        const LatencyHistogram &l = *h.second;
+        if (!l.count())
+            continue;
+        fprintf(fp, "  %-16s %8lu %9.2f %9.2f %9.2f %9.2f %9.2f\n", h.first.c_str(), (unsigned long)l.count(),
+                l.mean() / 1e6, l.percentile(50) / 1e6, l.percentile(90) / 1e6, l.percentile(99) / 1e6,
+                l.max() / 1e6);
+    }
+}
+
+void LatencyStats::forEach(const std::function<void(const std::string &, const LatencyHistogram &)> &fn) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &h : histograms_)
+        fn(h.first, *h.second);
+}
+
+void LatencyStats::reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &h : histograms_)
+        h.second->reset();
+}
+
+static volatile sig_atomic_t dump_requested = 0;
+
+static void requestDump(int) {
+    dump_requested = 1;
+}
+
+void LatencyStats::dumpOnSignal(int signo) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = requestDump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signo, &sa, nullptr);
+}
+
+bool LatencyStats::dumpRequested() {
+    if (!dump_requested)
+        return false;
+    dump_requested = 0;
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Now in nanoseconds on CLOCK_BOOTTIME, the clock libcamera's
+// SensorTimestamp uses, so points in our code can be subtracted from it.
+uint64_t latencyClock();
+
+// Log-linear histogram of durations: exact below 16 ns, then 16 buckets per
+// power of two (within 1/16 of the value, like an HDR histogram with two
+// significant digits) up to the full int64 range. record() is wait-free and
+// may be called from any number of threads.
+class LatencyHistogram {
+    public:
+        LatencyHistogram(){};
+
+        // Negative durations, e.g. from a clock mismatch, count as 0.
+        void record(int64_t ns);
+        void reset();
+
+        uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+        uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+        int64_t max() const { return max_.load(std::memory_order_relaxed); }
+        double mean() const;
+        // Upper bound of the bucket holding the p-th percentile (0-100).
+        int64_t percentile(double p) const;
+
+    private:
+        static constexpr int kSubBits = 4;
+        static constexpr int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+        static int bucket(uint64_t value);
+        static uint64_t bucketTop(int index);
+
+        std::atomic<uint64_t> buckets_[kBuckets] = {};
+        std::atomic<uint64_t> count_{0};
+        std::atomic<uint64_t> sum_{0};
+        std::atomic<int64_t> max_{0};
+};
+
+// Named histograms for the points a frame passes on its way from the
+// sensor to returnFrameBuffer(). Look a histogram up once and keep the
+// reference: lookups lock, recording doesn't.
+class LatencyStats {
+    public:
+        static LatencyStats &global();
+
+        // Created empty on first use; references stay valid.
+        LatencyHistogram &histogram(const std::string &name);
+        void print(FILE *fp = stdout) const;
+        void forEach(const std::function<void(const std::string &, const LatencyHistogram &)> &fn) const;
+        void reset();
+
+        // Makes signo (SIGUSR1 by default) set a flag that dumpRequested()
+        // reports and clears; printing from the handler itself isn't safe.
+        static void dumpOnSignal(int signo = SIGUSR1);
+        static bool dumpRequested();
+
+    private:
+        mutable std::mutex mutex_;
+        std::vector<std::pair<std::string, std::unique_ptr<LatencyHistogram>>> histograms_;
+};
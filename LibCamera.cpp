@@ -2,21 +2,81 @@
 
 using namespace std::placeholders;
 
+static std::mutex camera_manager_mutex;
+static std::condition_variable camera_manager_gone;
+static std::weak_ptr<CameraManager> camera_manager;
+// Whether a manager exists, cleared only once it is destroyed: its
+// weak_ptr expires before that, and a new one mustn't start meanwhile.
+static bool camera_manager_exists = false;
+
+std::shared_ptr<CameraManager> LibCamera::cameraManager() {
+    std::unique_lock<std::mutex> lock(camera_manager_mutex);
+    std::shared_ptr<CameraManager> manager;
+    camera_manager_gone.wait(lock, [&manager] {
+        manager = camera_manager.lock();
+        return manager || !camera_manager_exists;
+    });
+    if (manager)
+        return manager;
+    manager = std::shared_ptr<CameraManager>(new CameraManager, [](CameraManager *manager) {
+        delete manager;
+        {
+            std::lock_guard<std::mutex> lock(camera_manager_mutex);
+            camera_manager_exists = false;
+        }
+        camera_manager_gone.notify_all();
+    });
+    camera_manager_exists = true;
+    int ret = manager->start();
+    if (ret) {
+        std::cerr << "Failed to start camera manager: " << ret << std::endl;
+        // manager's deleter takes the lock as it goes
+        lock.unlock();
+        return nullptr;
+    }
+    camera_manager = manager;
+    return manager;
+}
+
+std::vector<std::string> LibCamera::cameraIds() {
+    std::vector<std::string> ids;
+    std::shared_ptr<CameraManager> manager = cameraManager();
+    if (manager) {
+        for (const std::shared_ptr<Camera> &camera : manager->cameras())
+            ids.push_back(camera->id());
+    }
+    return ids;
+}
+
+void LibCamera::setConfigCache(const std::string &path) {
+    cache_path_ = path;
+    if (!cache_.load(path))
+        std::cout << "No usable camera cache in " << path << ", starting cold" << std::endl;
+}
+
 int LibCamera::initCamera() {
-    int ret;
-    cm = std::make_unique<CameraManager>();
-    ret = cm->start();
-    if (ret){
-        std::cout << "Failed to start camera manager: "
-              << ret << std::endl;
-        return ret;
+    recordInit();
+    cm = cameraManager();
+    if (!cm)
+        return 1;
+    if (!requested_id_.empty()) {
+        camera_ = cm->get(requested_id_);
+        if (!camera_) {
+            std::cerr << "Camera " << requested_id_ << " not found" << std::endl;
+            return 1;
+        }
     }
-    cameraId = cm->cameras()[0]->id();
-    camera_ = cm->get(cameraId);
+    // The cached camera if it is still there, else the first one.
+    if (!camera_ && !cache_.cameraId.empty())
+        camera_ = cm->get(cache_.cameraId);
     if (!camera_) {
-        std::cerr << "Camera " << cameraId << " not found" << std::endl;
-        return 1;
+        if (cm->cameras().empty()) {
+            std::cerr << "No cameras available" << std::endl;
+            return 1;
+        }
+        camera_ = cm->cameras()[0];
     }
+    cameraId = camera_->id();
 
     if (camera_->acquire()) {
         std::cerr << "Failed to acquire camera " << cameraId
@@ -24,16 +84,37 @@ int LibCamera::initCamera() {
         return 1;
     }
     camera_acquired_ = true;
+
+    frame_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (frame_event_fd_ < 0) {
+        std::cerr << "Failed to create frame eventfd" << std::endl;
+        return 1;
+    }
     return 0;
 }
 
+size_t LibCamera::bufferSize() const {
+    size_t bytes = 0;
+    if (config_) {
+        for (const StreamConfiguration &cfg : *config_)
+            bytes += cfg.frameSize;
+    }
+    return bytes;
+}
+
 char * LibCamera::getCameraId(){
     return cameraId.data();
 }
 
-void LibCamera::configureStill(int width, int height, PixelFormat format, int buffercount, int rotation) {
+void LibCamera::configureStill(int width, int height, PixelFormat format, int buffercount, int rotation,
+                               int analysisWidth, int analysisHeight, PixelFormat analysisFormat) {
     printf("Configuring still capture...\n");
-    config_ = camera_->generateConfiguration({ StreamRole::StillCapture });
+    std::vector<StreamRole> roles = { StreamRole::StillCapture };
+    if (analysisWidth && analysisHeight)
+        roles.push_back(StreamRole::Viewfinder);
+    config_ = camera_->generateConfiguration(roles);
+    if (!config_ || config_->size() != roles.size())
+        throw std::runtime_error("failed to generate stream configurations");
     if (width && height) {
         libcamera::Size size(width, height);
         config_->at(0).size = size;
@@ -41,6 +122,21 @@ void LibCamera::configureStill(int width, int height, PixelFormat format, int bu
     config_->at(0).pixelFormat = format;
     if (buffercount)
         config_->at(0).bufferCount = buffercount;
+    if (config_->size() > 1) {
+        // Both streams complete in the same request, so they need the same
+        // number of buffers.
+        config_->at(1).size = libcamera::Size(analysisWidth, analysisHeight);
+        config_->at(1).pixelFormat = analysisFormat;
+        config_->at(1).bufferCount = config_->at(0).bufferCount;
+    }
+    still_width_ = width;
+    still_height_ = height;
+    still_format_ = format;
+    still_buffercount_ = buffercount;
+    still_rotation_ = rotation;
+    analysis_width_ = analysisWidth;
+    analysis_height_ = analysisHeight;
+    analysis_format_ = analysisFormat;
     Transform transform = Transform::Identity;
     bool ok;
     Transform rot = transformFromRotation(rotation, &ok);
@@ -51,11 +147,40 @@ void LibCamera::configureStill(int width, int height, PixelFormat format, int bu
         throw std::runtime_error("transforms requiring transpose not supported");
     config_->transform = transform;
 
+    // What validate() made of the same request last time: it then only
+    // has to confirm it.
+    std::string key = cacheKey();
+    bool cached = cache_.cameraId == cameraId && cache_.request == key && cache_.streams.size() == config_->size();
+    if (cached) {
+        for (unsigned int i = 0; i < config_->size(); i++) {
+            StreamConfiguration &cfg = config_->at(i);
+            const CameraCache::StreamConfig &stream = cache_.streams[i];
+            cfg.size = libcamera::Size(stream.width, stream.height);
+            cfg.pixelFormat = PixelFormat::fromString(stream.pixelFormat);
+            cfg.stride = stream.stride;
+            cfg.frameSize = stream.frameSize;
+            cfg.bufferCount = stream.bufferCount;
+        }
+    }
+
     CameraConfiguration::Status validation = config_->validate();
 	if (validation == CameraConfiguration::Invalid)
 		throw std::runtime_error("failed to valid stream configurations");
 	else if (validation == CameraConfiguration::Adjusted)
         std::cout << "Stream configuration adjusted" << std::endl;
+    else if (cached)
+        std::cout << "Using cached stream configuration" << std::endl;
+
+    if (!cached || validation != CameraConfiguration::Valid) {
+        cache_.cameraId = cameraId;
+        cache_.request = key;
+        cache_.streams.clear();
+        for (const StreamConfiguration &cfg : *config_) {
+            cache_.streams.push_back({ cfg.size.width, cfg.size.height, cfg.pixelFormat.toString(),
+                                       cfg.stride, cfg.frameSize, cfg.bufferCount });
+        }
+        cache_dirty_ = true;
+    }
 
     printf("Still capture setup complete\n");
 }
@@ -88,6 +213,7 @@ int LibCamera::startCapture() {
         unsigned int allocated = allocator_->buffers(cfg.stream()).size();
         nbuffers = std::min(nbuffers, allocated);
     }
+    requestQueue.reset(nbuffers);
 
     for (unsigned int i = 0; i < nbuffers; i++) {
         std::unique_ptr<Request> request = camera_->createRequest();
@@ -108,24 +234,60 @@ int LibCamera::startCapture() {
                       << std::endl;
                 return ret;
             }
+            // Planes of one buffer often share a dmabuf at different
+            // offsets; the cache maps each dmabuf once.
+            std::vector<uint8_t *> &planes = planeData_[buffer.get()];
+            planes.clear();
             for (const FrameBuffer::Plane &plane : buffer->planes()) {
-                void *memory = mmap(NULL, plane.length, PROT_READ, MAP_SHARED,
-                            plane.fd.get(), 0);
-                mappedBuffers_[plane.fd.get()] =
-                    std::make_pair(memory, plane.length);
+                uint8_t *memory = mappings_.map(plane.fd.get(), plane.offset + plane.length);
+                if (!memory)
+                    return -ENOMEM;
+                planes.push_back(memory + plane.offset);
             }
         }
 
         requests_.push_back(std::move(request));
     }
 
+    viewfinder_stream_ = config_->at(0).stream();
+    analysis_stream_ = config_->size() > 1 ? config_->at(1).stream() : nullptr;
+    return queueAllRequests();
+}
+
+int LibCamera::queueAllRequests() {
+    int ret;
+    // Start from the exposure and colour gains that had settled last time,
+    // unless they were set explicitly. Fixing them at start only seeds the
+    // algorithms: the first request hands them back by setting them to 0.
+    // That is the Raspberry Pi IPA's convention for "automatic" and this
+    // code relies on it; AeEnable/AwbEnable won't do there, as a fixed
+    // exposure or gain stays fixed with the algorithms running. Other IPAs
+    // may treat the 0s differently.
+    ControlList release;
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        ControlList seed;
+        if (cache_.exposureTime && !sticky_controls_.get(controls::ExposureTime) &&
+            !sticky_controls_.get(controls::AnalogueGain)) {
+            seed.set(controls::ExposureTime, cache_.exposureTime);
+            seed.set(controls::AnalogueGain, cache_.analogueGain);
+            release.set(controls::ExposureTime, 0);
+            release.set(controls::AnalogueGain, 0.0f);
+        }
+        if (cache_.colourGains[0] && cache_.colourGains[1] && !sticky_controls_.get(controls::ColourGains)) {
+            seed.set(controls::ColourGains, libcamera::Span<const float, 2>(cache_.colourGains));
+            const float automatic[2] = { 0, 0 };
+            release.set(controls::ColourGains, libcamera::Span<const float, 2>(automatic));
+        }
+        controls_.merge(seed);
+    }
     ret = camera_->start(&this->controls_);
     // ret = camera_->start();
     if (ret) {
         std::cout << "Failed to start capture" << std::endl;
         return ret;
     }
-    controls_.clear();
+    controls_ = std::move(release);
     camera_started_ = true;
     for (std::unique_ptr<Request> &request : requests_) {
         ret = queueRequest(request.get());
@@ -135,7 +297,6 @@ int LibCamera::startCapture() {
             return ret;
         }
     }
-    viewfinder_stream_ = config_->at(0).stream();
     return 0;
 }
 
@@ -156,6 +317,21 @@ Stream *LibCamera::VideoStream(uint32_t *w, uint32_t *h, uint32_t *stride) const
 	return viewfinder_stream_;
 }
 
+Stream *LibCamera::AnalysisStream(uint32_t *w, uint32_t *h, uint32_t *stride) const
+{
+	if (analysis_stream_) {
+		StreamDimensions(analysis_stream_, w, h, stride);
+	} else {
+		if (w)
+			*w = 0;
+		if (h)
+			*h = 0;
+		if (stride)
+			*stride = 0;
+	}
+	return analysis_stream_;
+}
+
 int LibCamera::queueRequest(Request *request) {
     std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
     if (!camera_started_)
@@ -168,18 +344,38 @@ int LibCamera::queueRequest(Request *request) {
 }
 
 void LibCamera::requestComplete(Request *request) {
-    if (request->status() == Request::RequestCancelled)
+    if (request->status() == Request::RequestCancelled) {
+        // Its buffers never get filled; stopping the camera cancels the
+        // ones still queued.
+        recordCancelled();
         return;
+    }
     processRequest(request);
 }
 
 void LibCamera::processRequest(Request *request) {
-    requestQueue.push(request);
+    uint64_t completed = latencyClock();
+    if (Trace::enabled()) {
+        // Exposure to completion, on libcamera's thread.
+        FrameBuffer *main = request->findBuffer(config_->at(0).stream());
+        std::optional<int64_t> sensorTimestamp = request->metadata().get(controls::SensorTimestamp);
+        Trace::complete("capture", sensorTimestamp ? *sensorTimestamp : completed, completed,
+                        main ? main->metadata().sequence : -1);
+    }
+    // The ring holds one slot per request, so it can never be full here.
+    if (!requestQueue.push(CompletedRequest{ request, completed })) {
+        std::cerr << "Completion queue overflow" << std::endl;
+        return;
+    }
+    uint64_t one = 1;
+    if (write(frame_event_fd_, &one, sizeof(one)) < 0)
+        std::cerr << "Failed to signal frame eventfd" << std::endl;
 }
 
 void LibCamera::returnFrameBuffer(LibcameraOutData frameData) {
     uint64_t request = frameData.request;
     Request * req = (Request *)request;
+    recordReturn(frameData);
     req->reuse(Request::ReuseBuffers);
     queueRequest(req);
 }
@@ -187,41 +383,135 @@ void LibCamera::returnFrameBuffer(LibcameraOutData frameData) {
 bool LibCamera::readFrame(LibcameraOutData *frameData){
     std::lock_guard<std::mutex> lock(free_requests_mutex_);
     // int w, h, stride;
-    if (!requestQueue.empty()){
-        Request *request = this->requestQueue.front();
-
-        const Request::BufferMap &buffers = request->buffers();
-        for (auto it = buffers.begin(); it != buffers.end(); ++it) {
-            FrameBuffer *buffer = it->second;
-            for (unsigned int i = 0; i < buffer->planes().size(); ++i) {
+    CompletedRequest completed;
+    Request *request;
+    if (requestQueue.pop(&completed)){
+        request = completed.request;
+
+        frameData->streamCount = 0;
+        for (unsigned int s = 0; s < config_->size() && s < kMaxStreams; ++s) {
+            const StreamConfiguration &cfg = config_->at(s);
+            FrameBuffer *buffer = request->findBuffer(cfg.stream());
+            if (!buffer)
+                break;
+            StreamView &view = frameData->streams[s];
+            view.format = cfg.pixelFormat;
+            view.width = cfg.size.width;
+            view.height = cfg.size.height;
+            view.planeCount = std::min<size_t>(buffer->planes().size(), 3);
+            for (unsigned int i = 0; i < view.planeCount; ++i) {
                 const FrameBuffer::Plane &plane = buffer->planes()[i];
                 const FrameMetadata::Plane &meta = buffer->metadata().planes()[i];
-                
-                void *data = mappedBuffers_[plane.fd.get()].first;
-                int length = std::min(meta.bytesused, plane.length);
 
-                frameData->size = length;
-                frameData->imageData = (uint8_t *)data;
+                view.planes[i] = { planeData_[buffer][i], plane.offset, planeStride(cfg.pixelFormat, cfg.stride, i),
+                                   std::min(meta.bytesused, plane.length), plane.length, plane.fd.get() };
             }
+            frameData->streamCount++;
         }
-        this->requestQueue.pop();
+        if (!frameData->streamCount) {
+            // Nothing to hand out without the main stream: straight back.
+            std::cerr << "Request completed without a main stream buffer" << std::endl;
+            request->reuse(Request::ReuseBuffers);
+            queueRequest(request);
+            frameData->request = 0;
+            return false;
+        }
+        FrameBuffer *main = request->findBuffer(config_->at(0).stream());
+        frameData->sequence = main ? main->metadata().sequence : request->sequence();
+        // SensorTimestamp is the start of exposure on CLOCK_BOOTTIME; the
+        // buffer timestamp (CLOCK_MONOTONIC) is only a fallback.
+        std::optional<int64_t> sensorTimestamp = request->metadata().get(controls::SensorTimestamp);
+        frameData->timestamp = sensorTimestamp ? *sensorTimestamp : main ? main->metadata().timestamp : 0;
+        frameData->completed = completed.completed;
+        frameData->imageData = frameData->streams[kMainStream].planes[0].data;
+        frameData->size = frameData->streams[kMainStream].planes[0].bytesused;
         frameData->request = (uint64_t)request;
+        // Until AE reports convergence the frame is not what a cold start
+        // is waiting for. Sensors that report neither are taken as settled.
+        const ControlList &metadata = request->metadata();
+        std::optional<int32_t> aeState = metadata.get(controls::AeState);
+        std::optional<bool> aeLocked = metadata.get(controls::AeLocked);
+        bool settled = aeState ? *aeState == controls::AeStateConverged : aeLocked ? *aeLocked : true;
+        if (settled && !cache_path_.empty())
+            updateCacheExposure(metadata);
+        recordDequeue(frameData, settled);
         return true;
     } else {
-        Request *request = nullptr;
+        request = nullptr;
         frameData->request = (uint64_t)request;
+        recordEmptyPoll();
         return false;
     }
 }
 
+bool LibCamera::readFrame(LibcameraOutData *frameData, int timeout_ms) {
+    return waitForFrame(frameData, frame_event_fd_, timeout_ms);
+}
+
+std::string LibCamera::cacheKey() const {
+    std::ostringstream key;
+    key << still_width_ << "x" << still_height_ << " " << still_format_.toString() << " " << still_buffercount_
+        << " " << still_rotation_;
+    if (analysis_width_ && analysis_height_)
+        key << " " << analysis_width_ << "x" << analysis_height_ << " " << analysis_format_.toString();
+    return key.str();
+}
+
+void LibCamera::updateCacheExposure(const ControlList &metadata) {
+    std::optional<int32_t> exposure = metadata.get(controls::ExposureTime);
+    std::optional<float> gain = metadata.get(controls::AnalogueGain);
+    std::optional<Span<const float, 2>> colourGains = metadata.get(controls::ColourGains);
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    if (exposure && gain) {
+        cache_dirty_ |= cache_.exposureTime != *exposure || cache_.analogueGain != *gain;
+        cache_.exposureTime = *exposure;
+        cache_.analogueGain = *gain;
+    }
+    if (colourGains) {
+        cache_dirty_ |= cache_.colourGains[0] != (*colourGains)[0] || cache_.colourGains[1] != (*colourGains)[1];
+        cache_.colourGains[0] = (*colourGains)[0];
+        cache_.colourGains[1] = (*colourGains)[1];
+    }
+}
+
 void LibCamera::set(ControlList controls){
     std::lock_guard<std::mutex> lock(control_mutex_);
+    // Remembered for restarts, newest values first.
+    ControlList sticky = controls;
+    sticky.merge(sticky_controls_);
+    sticky_controls_ = std::move(sticky);
 	this->controls_ = std::move(controls);
 }
 
+// Restarting resets the camera's control state, so it gets everything set
+// so far again.
+void LibCamera::restoreControls() {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    controls_ = sticky_controls_;
+}
+
 int LibCamera::resetCamera(int width, int height, PixelFormat format, int buffercount, int rotation) {
+    if (camera_started_ && width == still_width_ && height == still_height_ && format == still_format_ &&
+        buffercount == still_buffercount_ && rotation == still_rotation_) {
+        // Same streams: keep the allocator, the requests and the mappings,
+        // and only cycle the camera.
+        {
+            std::lock_guard<std::mutex> lock(camera_stop_mutex_);
+            if (camera_->stop())
+                throw std::runtime_error("failed to stop camera");
+            camera_started_ = false;
+        }
+        clearCompleted();
+        for (std::unique_ptr<Request> &request : requests_)
+            request->reuse(Request::ReuseBuffers);
+        restoreControls();
+        return queueAllRequests();
+    }
+
     stopCamera();
-    configureStill(width, height, format, buffercount, rotation);
+    configureStill(width, height, format, buffercount, rotation,
+                   analysis_width_, analysis_height_, analysis_format_);
+    restoreControls();
     return startCamera();
 }
 
@@ -237,16 +527,12 @@ void LibCamera::stopCamera() {
         }
         camera_->requestCompleted.disconnect(this, &LibCamera::requestComplete);
     }
-    while (!requestQueue.empty())
-        requestQueue.pop();
-
-    for (auto &iter : mappedBuffers_)
-	{
-        std::pair<void *, unsigned int> pair_ = iter.second;
-		munmap(std::get<0>(pair_), std::get<1>(pair_));
-	}
+    clearCompleted();
 
-    mappedBuffers_.clear();
+    // The allocator is about to free the buffers, so their mappings can't
+    // be reused; unmap them rather than keep the memory pinned.
+    planeData_.clear();
+    mappings_.clear();
 
     requests_.clear();
 
@@ -255,7 +541,20 @@ void LibCamera::stopCamera() {
     controls_.clear();
 }
 
+// Forgets completed requests nobody has read, after the camera has stopped.
+void LibCamera::clearCompleted() {
+    CompletedRequest request;
+    while (requestQueue.pop(&request))
+        ;
+    uint64_t count;
+    if (frame_event_fd_ >= 0 && read(frame_event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        std::cerr << "Failed to clear frame eventfd" << std::endl;
+}
+
 void LibCamera::closeCamera(){
+    if (!cache_path_.empty() && cache_dirty_ && cache_.save(cache_path_))
+        cache_dirty_ = false;
+
     if (camera_acquired_)
         camera_->release();
     camera_acquired_ = false;
@@ -263,4 +562,8 @@ void LibCamera::closeCamera(){
     camera_.reset();
 
     cm.reset();
+
+    if (frame_event_fd_ >= 0)
+        close(frame_event_fd_);
+    frame_event_fd_ = -1;
 }
@@ -1,10 +1,14 @@
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
 #include <iomanip>
 #include <iostream>
 #include <signal.h>
 #include <limits.h>
 #include <memory>
 #include <stdint.h>
+#include <string.h>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -14,6 +18,8 @@
 #include <unistd.h>
 #include <time.h>
 #include <mutex>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <libcamera/controls.h>
 #include <libcamera/control_ids.h>
@@ -27,35 +33,69 @@
 #include <libcamera/formats.h>
 #include <libcamera/transform.h>
 
-using namespace libcamera;
+#include "CameraCache.h"
+#include "DmabufCache.h"
+#include "FrameSource.h"
+#include "LatencyStats.h"
+#include "Trace.h"
+#include "SpscRing.h"
 
-typedef struct {
-    uint8_t *imageData;
-    uint32_t size;
-    uint64_t request;
-} LibcameraOutData;
+using namespace libcamera;
 
-class LibCamera {
+class LibCamera : public FrameSource {
     public:
         LibCamera(){};
+        // Opens the camera with this ID (see cameraIds()) rather than the
+        // cached or the first one.
+        explicit LibCamera(const std::string &cameraId) : requested_id_(cameraId) {}
         ~LibCamera(){};
-        
-        int initCamera();
-        void configureStill(int width, int height, PixelFormat format, int buffercount, int rotation);
-        int startCamera();
-        int resetCamera(int width, int height, PixelFormat format, int buffercount, int rotation);
-        bool readFrame(LibcameraOutData *frameData);
-        void returnFrameBuffer(LibcameraOutData frameData);
 
-        void set(ControlList controls);
-        void stopCamera();
-        void closeCamera();
+        // libcamera allows one CameraManager per process, so every
+        // LibCamera shares this one. It is started on first use and
+        // stopped when the last camera using it is closed; nullptr if it
+        // can't be started.
+        static std::shared_ptr<CameraManager> cameraManager();
+        // IDs of the cameras present, in libcamera's order.
+        static std::vector<std::string> cameraIds();
+
+        int initCamera() override;
+        void configureStill(int width, int height, PixelFormat format, int buffercount, int rotation,
+                            int analysisWidth = 0, int analysisHeight = 0,
+                            PixelFormat analysisFormat = formats::YUV420) override;
+        int startCamera() override;
+        // Restarts without reallocating or remapping buffers when the
+        // configuration is unchanged, and reconfigures otherwise (e.g. to
+        // another buffer count), keeping the analysis stream and controls.
+        // Every frame must have been returned.
+        int resetCamera(int width, int height, PixelFormat format, int buffercount, int rotation) override;
+        bool readFrame(LibcameraOutData *frameData) override;
+        // Waits up to timeout_ms (-1 for ever) for a completed request.
+        bool readFrame(LibcameraOutData *frameData, int timeout_ms) override;
+        void returnFrameBuffer(LibcameraOutData frameData) override;
 
-        Stream *VideoStream(uint32_t *w, uint32_t *h, uint32_t *stride) const;
-        char * getCameraId();
+        void set(ControlList controls) override;
+        void stopCamera() override;
+        void closeCamera() override;
+
+        Stream *VideoStream(uint32_t *w, uint32_t *h, uint32_t *stride) const override;
+        Stream *AnalysisStream(uint32_t *w, uint32_t *h, uint32_t *stride) const override;
+        char * getCameraId() override;
+        size_t bufferSize() const override;
+
+        // Before initCamera(): remembers the camera, its validated streams
+        // and the last settled exposure in path (see CameraCache.h), so the
+        // next run opens the same camera, starts from the same streams and
+        // seeds AE/AWB instead of settling from scratch. Written by
+        // closeCamera().
+        void setConfigCache(const std::string &path);
 
     private:
         int startCapture();
+        int queueAllRequests();
+        void clearCompleted();
+        void restoreControls();
+        std::string cacheKey() const;
+        void updateCacheExposure(const ControlList &metadata);
         int queueRequest(Request *request);
         void requestComplete(Request *request);
         void processRequest(Request *request);
@@ -64,7 +104,7 @@ class LibCamera {
 
         unsigned int cameraIndex_;
 	    uint64_t last_;
-        std::unique_ptr<CameraManager> cm;
+        std::shared_ptr<CameraManager> cm;
         std::shared_ptr<Camera> camera_;
         bool camera_acquired_ = false;
         bool camera_started_ = false;
@@ -72,15 +112,38 @@ class LibCamera {
         std::unique_ptr<FrameBufferAllocator> allocator_;
         std::vector<std::unique_ptr<Request>> requests_;
         // std::map<std::string, Stream *> stream_;
-        std::map<int, std::pair<void *, unsigned int>> mappedBuffers_;
+        // Kept across soft restarts; planeData_ points into it.
+        DmabufCache mappings_;
+        std::map<const FrameBuffer *, std::vector<uint8_t *>> planeData_;
 
-        std::queue<Request *> requestQueue;
+        // Filled from libcamera's callback thread, drained by readFrame().
+        struct CompletedRequest {
+            Request *request;
+            uint64_t completed;  // latencyClock()
+        };
+        SpscRing<CompletedRequest> requestQueue;
+        int frame_event_fd_ = -1;
 
         ControlList controls_;
+        ControlList sticky_controls_;
         std::mutex control_mutex_;
         std::mutex camera_stop_mutex_;
         std::mutex free_requests_mutex_;
 
         Stream *viewfinder_stream_ = nullptr;
+        Stream *analysis_stream_ = nullptr;
+        int still_width_ = 0;
+        int still_height_ = 0;
+        PixelFormat still_format_;
+        int still_buffercount_ = 0;
+        int still_rotation_ = 0;
+        int analysis_width_ = 0;
+        int analysis_height_ = 0;
+        PixelFormat analysis_format_;
         std::string cameraId;
+        std::string requested_id_;
+
+        std::string cache_path_;
+        CameraCache cache_;  // exposure fields under control_mutex_
+        bool cache_dirty_ = false;
 };
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "MetricsServer.h"
+
+void MetricsWriter::family(const char *name, const char *type, const char *help) {
+    out_ += "# HELP ";
+    out_ += name;
+    out_ += ' ';
+    out_ += help;
+    out_ += "\n# TYPE ";
+    out_ += name;
+    out_ += ' ';
+    out_ += type;
+    out_ += '\n';
+}
+
+void MetricsWriter::sample(const char *name, double value, const std::string &labels) {
+    char number[32];
+    snprintf(number, sizeof(number), "%.15g", value);
+    out_ += name;
+    if (!labels.empty()) {
+        out_ += '{';
+        out_ += labels;
+        out_ += '}';
+    }
+    out_ += ' ';
+    out_ += number;
+    out_ += '\n';
+}
+
+void MetricsWriter::counter(const char *name, const char *help, double value) {
+    family(name, "counter", help);
+    sample(name, value);
+}
+
+void MetricsWriter::gauge(const char *name, const char *help, double value) {
+    family(name, "gauge", help);
+    sample(name, value);
+}
+
+int MetricsServer::start(const std::string &address) {
+    stop();
+    int ret;
+    if (address.find('/') != std::string::npos) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Metrics socket path too long: " << address << std::endl;
+            return -EINVAL;
+        }
+        strcpy(addr.sun_path, address.c_str());
+        // A socket left behind by an earlier run would make bind() fail;
+        // anything else there isn't ours to remove.
+        struct stat st;
+        if (!lstat(addr.sun_path, &st)) {
+            if (!S_ISSOCK(st.st_mode)) {
+                std::cerr << "Not serving metrics on " << address << ": not a socket" << std::endl;
+                return -EEXIST;
+            }
+            unlink(addr.sun_path);
+        }
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ret = listen_fd_ < 0 ? -1 : bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        if (!ret)
+            socket_path_ = address;
+    } else {
+        char *end;
+        long port = strtol(address.c_str(), &end, 10);
+        if (address.empty() || *end || port < 1 || port > 65535) {
+            std::cerr << "Metrics address must be a port (1-65535) or a socket path: " << address << std::endl;
+            return -EINVAL;
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        ret = listen_fd_ < 0 ? -1 : setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!ret)
+            ret = bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    }
+    if (!ret)
+        ret = listen(listen_fd_, 4);
+    if (ret) {
+        ret = -errno;
+        std::cerr << "Failed to serve metrics on " << address << ": " << strerror(errno) << std::endl;
+        stop();
+        return ret;
+    }
+
+    stop_fd_ = eventfd(0, EFD_CLOEXEC);
+    thread_ = std::thread(&MetricsServer::run, this);
+    return 0;
+}
+
+void MetricsServer::stop() {
+    if (thread_.joinable()) {
+        uint64_t one = 1;
+        if (write(stop_fd_, &one, sizeof(one)) < 0)
+            std::cerr << "Failed to stop metrics server" << std::endl;
+        thread_.join();
+    }
+    if (listen_fd_ >= 0)
+        close(listen_fd_);
+    if (stop_fd_ >= 0)
+        close(stop_fd_);
+    if (!socket_path_.empty())
+        unlink(socket_path_.c_str());
+    listen_fd_ = -1;
+    stop_fd_ = -1;
+    socket_path_.clear();
+}
+
+void MetricsServer::run() {
+    pthread_setname_np(pthread_self(), "metrics");
+    while (true) {
+        struct pollfd fds[2] = { { listen_fd_, POLLIN, 0 }, { stop_fd_, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Metrics server: " << strerror(errno) << std::endl;
+            return;
+        }
+        if (fds[1].revents)
+            return;
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        serve(fd);
+        close(fd);
+    }
+}
+
+// One request per connection; anything but GET / or GET /metrics is a 404.
+void MetricsServer::serve(int fd) {
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        // Don't let a silent client hold up the next scrape for long.
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0)
+            return;
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+            return;
+        request.append(buffer, n);
+    }
+
+    std::string body;
+    const char *status = "200 OK";
+    if (request.rfind("GET / ", 0) == 0 || request.rfind("GET /metrics ", 0) == 0) {
+        MetricsWriter writer(body);
+        for (const Collector &collector : collectors_)
+            collector(writer);
+    } else {
+        status = "404 Not Found";
+        body = "Try /metrics\n";
+    }
+
+    std::string response = std::string("HTTP/1.0 ") + status +
+                           "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        sent += n;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Builds a Prometheus text exposition (format 0.0.4) snapshot.
+class MetricsWriter {
+    public:
+        MetricsWriter(std::string &out) : out_(out) {}
+
+        // Starts a metric family; its samples follow with sample().
+        void family(const char *name, const char *type, const char *help);
+        // labels is the inside of the braces, e.g. stage="analyze", or empty.
+        void sample(const char *name, double value, const std::string &labels = "");
+
+        // A family with a single unlabelled sample.
+        void counter(const char *name, const char *help, double value);
+        void gauge(const char *name, const char *help, double value);
+
+    private:
+        std::string &out_;
+};
+
+// Serves a metrics snapshot over HTTP, on 127.0.0.1:port or on a Unix
+// socket (curl --unix-socket PATH http://localhost/metrics). Nothing is
+// collected or formatted until a request arrives: collectors run on the
+// server thread, reading counters the hot path keeps anyway.
+class MetricsServer {
+    public:
+        typedef std::function<void(MetricsWriter &)> Collector;
+
+        MetricsServer(){};
+        ~MetricsServer() { stop(); }
+
+        // Collectors must be added before start().
+        void addCollector(Collector collector) { collectors_.push_back(std::move(collector)); }
+        // address is a TCP port, or a socket path if it contains a '/'.
+        int start(const std::string &address);
+        void stop();
+
+    private:
+        void run();
+        void serve(int fd);
+
+        std::vector<Collector> collectors_;
+        std::string socket_path_;
+        int listen_fd_ = -1;
+        int stop_fd_ = -1;
+        std::thread thread_;
+};
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "MultiCapture.h"
+#include "Trace.h"
+
+// How long a camera thread waits for a frame before checking for stop().
+static constexpr int kPollMs = 100;
+
+MultiCapture::MultiCapture(const std::vector<FrameSource *> &sources) {
+    for (FrameSource *source : sources) {
+        cameras_.push_back(std::make_unique<Camera>());
+        cameras_.back()->source = source;
+    }
+}
+
+void MultiCapture::onFrameSet(SetCallback callback, uint64_t toleranceNs, unsigned int maxPending) {
+    setCallback_ = std::move(callback);
+    tolerance_ = toleranceNs;
+    maxPending_ = std::max(maxPending, 1u);
+}
+
+void MultiCapture::start() {
+    running_ = true;
+    for (unsigned int i = 0; i < cameras_.size(); i++)
+        cameras_[i]->thread = std::thread(&MultiCapture::run, this, i);
+}
+
+void MultiCapture::stop() {
+    running_ = false;
+    for (std::unique_ptr<Camera> &camera : cameras_) {
+        if (camera->thread.joinable())
+            camera->thread.join();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::unique_ptr<Camera> &camera : cameras_)
+        camera->pending.clear();
+}
+
+void MultiCapture::run(unsigned int index) {
+    char name[16];
+    snprintf(name, sizeof(name), "capture%u", index);
+    pthread_setname_np(pthread_self(), name);
+
+    Camera &camera = *cameras_[index];
+    while (running_.load(std::memory_order_relaxed)) {
+        Frame frame = camera.source->nextFrame(kPollMs);
+        if (!frame)
+            continue;
+        camera.frames.fetch_add(1, std::memory_order_relaxed);
+        if (setCallback_)
+            match(index, std::move(frame));
+        else if (frameCallback_)
+            frameCallback_(index, std::move(frame));
+    }
+}
+
+void MultiCapture::match(unsigned int index, Frame frame) {
+    // Filled under the lock, handed out (or given back) after it.
+    std::vector<FrameSet> sets;
+    std::vector<Frame> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::deque<Frame> &pending = cameras_[index]->pending;
+        pending.push_back(std::move(frame));
+        if (pending.size() > maxPending_) {
+            dropped.push_back(std::move(pending.front()));
+            pending.pop_front();
+        }
+
+        // Either the oldest frames of all cameras are close enough to make a
+        // set, or the oldest of them can never be part of one: every other
+        // camera has already moved past it.
+        for (;;) {
+            uint64_t earliest = UINT64_MAX, latest = 0;
+            unsigned int oldest = 0;
+            bool complete = true;
+            for (unsigned int i = 0; i < cameras_.size(); i++) {
+                if (cameras_[i]->pending.empty()) {
+                    complete = false;
+                    break;
+                }
+                uint64_t timestamp = cameras_[i]->pending.front().timestamp();
+                if (timestamp < earliest) {
+                    earliest = timestamp;
+                    oldest = i;
+                }
+                latest = std::max(latest, timestamp);
+            }
+            if (!complete)
+                break;
+            if (latest - earliest > tolerance_) {
+                dropped.push_back(std::move(cameras_[oldest]->pending.front()));
+                cameras_[oldest]->pending.pop_front();
+                continue;
+            }
+            FrameSet set;
+            set.timestamp = earliest;
+            set.skew = latest - earliest;
+            for (std::unique_ptr<Camera> &camera : cameras_) {
+                set.frames.push_back(std::move(camera->pending.front()));
+                camera->pending.pop_front();
+            }
+            sets.push_back(std::move(set));
+        }
+    }
+
+    unmatched_.fetch_add(dropped.size(), std::memory_order_relaxed);
+    dropped.clear();
+    for (FrameSet &set : sets) {
+        sets_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = maxSkew_.load(std::memory_order_relaxed);
+        while (set.skew > max && !maxSkew_.compare_exchange_weak(max, set.skew, std::memory_order_relaxed))
+            ;
+        Trace::instant("frameSet", set.frames[0].sequence());
+        setCallback_(set);
+    }
+}
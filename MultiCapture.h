@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "Frame.h"
+#include "FrameSource.h"
+
+// One frame from every camera of a MultiCapture, exposed within the sync
+// tolerance of each other. frames is indexed like the sources.
+struct FrameSet {
+    std::vector<Frame> frames;
+    uint64_t timestamp;  // earliest start of exposure
+    uint64_t skew;       // latest minus earliest, ns
+};
+
+// Reads several started sources at once, each on a thread of its own, so
+// the cameras don't wait on each other and throughput grows with their
+// number. Frames are either handed out one by one, on the thread of the
+// camera they came from, or grouped into FrameSets by sensor timestamp.
+//
+// A FrameSet is delivered on the thread of the camera that completed it. A
+// frame that can't be matched (its partners were lost, or it waited
+// behind maxPending newer ones) is given back to its camera.
+class MultiCapture {
+    public:
+        typedef std::function<void(unsigned int camera, Frame frame)> FrameCallback;
+        typedef std::function<void(FrameSet &set)> SetCallback;
+
+        // The sources must outlive the MultiCapture.
+        MultiCapture(const std::vector<FrameSource *> &sources);
+        ~MultiCapture() { stop(); }
+
+        // One of these before start().
+        void onFrame(FrameCallback callback) { frameCallback_ = std::move(callback); }
+        void onFrameSet(SetCallback callback, uint64_t toleranceNs, unsigned int maxPending = 2);
+
+        void start();
+        // Joins the threads; frames still waiting for a set go back.
+        void stop();
+
+        unsigned int cameras() const { return cameras_.size(); }
+        uint64_t frames(unsigned int camera) const { return cameras_[camera]->frames.load(std::memory_order_relaxed); }
+        uint64_t sets() const { return sets_.load(std::memory_order_relaxed); }
+        uint64_t unmatched() const { return unmatched_.load(std::memory_order_relaxed); }
+        uint64_t maxSkew() const { return maxSkew_.load(std::memory_order_relaxed); }
+
+    private:
+        struct Camera {
+            FrameSource *source;
+            std::thread thread;
+            std::atomic<uint64_t> frames{0};
+            // Waiting for partners, oldest first; under mutex_.
+            std::deque<Frame> pending;
+        };
+
+        void run(unsigned int index);
+        void match(unsigned int index, Frame frame);
+
+        std::vector<std::unique_ptr<Camera>> cameras_;
+        FrameCallback frameCallback_;
+        SetCallback setCallback_;
+        uint64_t tolerance_ = 0;
+        unsigned int maxPending_ = 2;
+
+        std::mutex mutex_;
+        std::atomic<bool> running_{false};
+        std::atomic<uint64_t> sets_{0};
+        std::atomic<uint64_t> unmatched_{0};
+        std::atomic<uint64_t> maxSkew_{0};
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <utility>
+#include <vector>
+
+// What a stage does when its input queue is full.
+enum class QueuePolicy {
+    Block,      // the upstream side waits for space (backpressure)
+    DropOldest, // the longest waiting item is discarded
+    DropNewest, // the incoming item is discarded
+};
+
+// A graph of processing stages, each running on its own thread behind a
+// bounded queue. Items enter with push() and flow from a stage to every
+// stage added downstream of it, so the throughput is set by the slowest
+// stage rather than by the sum of all of them.
+//
+// T is passed by value: it is moved along a chain and copied when a stage
+// feeds several others, so resources are best held through something like
+// a std::shared_ptr whose deleter hands them back. An item dropped by a
+// queue policy is simply destroyed.
+//
+// Each stage counts what its own queue dropped, and reports what the
+// queues of the stages above it dropped, which tells where frames went
+// missing. Items a stage chose not to pass on are neither.
+template <typename T>
+class Pipeline {
+    public:
+        // Returns whether the item should continue to the downstream stages.
+        typedef std::function<bool(T &)> StageFn;
+
+        static constexpr int kSource = -1;
+        static constexpr int kAnyCpu = -1;
+
+        struct StageStats {
+            std::string name;
+            uint64_t processed;
+            uint64_t dropped;   // discarded by this stage's queue policy
+            uint64_t gaps;      // dropped by the queues of the stages above
+            size_t depth;
+            size_t maxDepth;
+            size_t capacity;
+            double avgMs;
+            double maxMs;
+            double cpuMs;       // CPU time of the stage thread
+        };
+
+        Pipeline() {}
+        ~Pipeline() { stop(); }
+
+        // Adds a stage fed by upstream (an earlier addStage() index, or
+        // kSource for items pushed directly) and returns its index. cpu
+        // picks the core the stage thread is pinned to; kAnyCpu spreads
+        // stages over the cores other than core 0, keeping them clear of
+        // it for the unpinned threads, capture among them. Stages must be
+        // added before start().
+        int addStage(const std::string &name, StageFn fn, size_t capacity, QueuePolicy policy,
+                     int upstream = kSource, int cpu = kAnyCpu) {
+            std::unique_ptr<Stage> stage(new Stage);
+            stage->name = name;
+            stage->fn = std::move(fn);
+            stage->capacity = std::max<size_t>(capacity, 1);
+            stage->policy = policy;
+            stage->cpu = cpu;
+            stage->upstream = upstream;
+            int index = stages_.size();
+            if (upstream == kSource)
+                roots_.push_back(index);
+            else
+                stages_[upstream]->children.push_back(index);
+            stages_.push_back(std::move(stage));
+            return index;
+        }
+
+        void start() {
+            unsigned int cpus = std::thread::hardware_concurrency();
+            for (size_t i = 0; i < stages_.size(); i++) {
+                Stage &stage = *stages_[i];
+                if (stage.cpu == kAnyCpu && cpus > 1)
+                    stage.cpu = 1 + i % (cpus - 1);
+                stage.thread = std::thread(&Pipeline::run, this, &stage);
+            }
+        }
+
+        // Feeds an item to the root stages.
+        void push(T item) {
+            forward(roots_, item);
+        }
+
+        // Blocks until everything pushed so far has left the pipeline.
+        // Must not be called concurrently with push().
+        void drain() {
+            // Stages are added after their upstream, so once a stage is idle
+            // nothing can reach it any more.
+            for (std::unique_ptr<Stage> &stage : stages_) {
+                std::unique_lock<std::mutex> lock(stage->mutex);
+                stage->idle.wait(lock, [&stage] { return stage->queue.empty() && !stage->busy; });
+            }
+        }
+
+        // Finishes the queued items and joins the stage threads.
+        void stop() {
+            for (std::unique_ptr<Stage> &stage : stages_) {
+                if (!stage->thread.joinable())
+                    continue;
+                {
+                    std::lock_guard<std::mutex> lock(stage->mutex);
+                    stage->stopping = true;
+                }
+                stage->not_empty.notify_all();
+                stage->thread.join();
+            }
+        }
+
+        std::vector<StageStats> stats() const {
+            std::vector<StageStats> result;
+            for (const std::unique_ptr<Stage> &stage : stages_) {
+                // Stages come after their upstream, whose figures are in.
+                uint64_t gaps = 0;
+                if (stage->upstream != kSource)
+                    gaps = result[stage->upstream].gaps + result[stage->upstream].dropped;
+                std::lock_guard<std::mutex> lock(stage->mutex);
+                result.push_back({ stage->name, stage->processed, stage->dropped, gaps,
+                                   stage->queue.size(), stage->max_depth, stage->capacity,
+                                   stage->processed ? stage->total_ms / stage->processed : 0, stage->max_ms,
+                                   cpuMs(*stage) });
+            }
+            return result;
+        }
+
+        void printStats(FILE *fp = stdout) const {
+            for (const StageStats &s : stats())
+                fprintf(fp, "  %-10s %6lu done %6lu dropped %6lu lost upstream, queue max %zu/%zu, %.2f ms avg / %.2f ms max, %.0f ms cpu\n",
+                        s.name.c_str(), (unsigned long)s.processed, (unsigned long)s.dropped,
+                        (unsigned long)s.gaps, s.maxDepth, s.capacity, s.avgMs, s.maxMs, s.cpuMs);
+        }
+
+    private:
+        struct Stage {
+            std::string name;
+            StageFn fn;
+            size_t capacity;
+            QueuePolicy policy;
+            int cpu;
+            int upstream;
+            std::vector<int> children;
+
+            mutable std::mutex mutex;
+            std::condition_variable not_empty;
+            std::condition_variable not_full;
+            std::condition_variable idle;
+            std::deque<T> queue;
+            bool busy = false;
+            bool stopping = false;
+            std::thread thread;
+
+            bool has_cpu_clock = false;
+            clockid_t cpu_clock;
+            double cpu_ms = 0;
+
+            uint64_t processed = 0;
+            uint64_t dropped = 0;
+            size_t max_depth = 0;
+            double total_ms = 0;
+            double max_ms = 0;
+        };
+
+        // Called with the stage lock held. The thread's clock only exists
+        // while it runs, so run() saves the final figure on its way out.
+        static double cpuMs(const Stage &stage) {
+            struct timespec ts;
+            if (!stage.has_cpu_clock || clock_gettime(stage.cpu_clock, &ts))
+                return stage.cpu_ms;
+            return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+        }
+
+        void forward(const std::vector<int> &targets, T &item) {
+            for (size_t i = 0; i < targets.size(); i++) {
+                if (i + 1 < targets.size())
+                    enqueue(*stages_[targets[i]], T(item));
+                else
+                    enqueue(*stages_[targets[i]], std::move(item));
+            }
+        }
+
+        void enqueue(Stage &stage, T &&item) {
+            // Whatever gets dropped is destroyed once the lock is released.
+            std::deque<T> victim;
+            std::unique_lock<std::mutex> lock(stage.mutex);
+            if (stage.queue.size() >= stage.capacity) {
+                switch (stage.policy) {
+                case QueuePolicy::Block:
+                    stage.not_full.wait(lock, [&stage] { return stage.queue.size() < stage.capacity; });
+                    break;
+                case QueuePolicy::DropOldest:
+                    victim.push_back(std::move(stage.queue.front()));
+                    stage.queue.pop_front();
+                    stage.dropped++;
+                    break;
+                case QueuePolicy::DropNewest:
+                    victim.push_back(std::move(item));
+                    stage.dropped++;
+                    return;
+                }
+            }
+            stage.queue.push_back(std::move(item));
+            stage.max_depth = std::max(stage.max_depth, stage.queue.size());
+            lock.unlock();
+            stage.not_empty.notify_one();
+        }
+
+        // Takes the item by value so it is released before the stage lock
+        // is taken again.
+        double process(Stage &stage, T item) {
+            auto start = std::chrono::steady_clock::now();
+            bool keep = stage.fn(item);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (keep)
+                forward(stage.children, item);
+            return ms;
+        }
+
+        void run(Stage *stage) {
+            pthread_setname_np(pthread_self(), stage->name.substr(0, 15).c_str());
+            if (stage->cpu >= 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(stage->cpu, &set);
+                if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+                    fprintf(stderr, "%s: could not pin to cpu %d\n", stage->name.c_str(), stage->cpu);
+            }
+
+            std::unique_lock<std::mutex> lock(stage->mutex);
+            stage->has_cpu_clock = !pthread_getcpuclockid(pthread_self(), &stage->cpu_clock);
+            while (true) {
+                stage->not_empty.wait(lock, [stage] { return stage->stopping || !stage->queue.empty(); });
+                if (stage->queue.empty()) {
+                    stage->cpu_ms = cpuMs(*stage);
+                    stage->has_cpu_clock = false;
+                    return;
+                }
+                T item = std::move(stage->queue.front());
+                stage->queue.pop_front();
+                stage->busy = true;
+                lock.unlock();
+                stage->not_full.notify_one();
+
+                double ms = process(*stage, std::move(item));
+
+                lock.lock();
+                stage->processed++;
+                stage->total_ms += ms;
+                stage->max_ms = std::max(stage->max_ms, ms);
+                stage->busy = false;
+                if (stage->queue.empty())
+                    stage->idle.notify_all();
+            }
+        }
+
+        std::vector<std::unique_ptr<Stage>> stages_;
+        std::vector<int> roots_;
+};
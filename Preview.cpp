@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+#ifndef HEADLESS
+#include <opencv2/highgui.hpp>
+#endif
+#include <pthread.h>
+
+#include "LatencyStats.h"
+#include "Preview.h"
+#include "Trace.h"
+
+Preview::Preview(const std::string &title, uint32_t maxWidth, uint32_t maxHeight, double maxFps)
+    : title_(title), maxWidth_(maxWidth), maxHeight_(maxHeight), interval_(maxFps > 0 ? 1e9 / maxFps : 0) {
+}
+
+bool Preview::start() {
+#ifdef HEADLESS
+    return false;
+#else
+    if (running_)
+        return true;
+    running_ = true;
+    thread_ = std::thread(&Preview::run, this);
+    return true;
+#endif
+}
+
+void Preview::stop() {
+    running_ = false;
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void Preview::offer(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride, uint64_t sequence) {
+    if (!running_.load(std::memory_order_relaxed))
+        return;
+    uint64_t now = latencyClock();
+    if (now < next_)
+        return;
+    next_ = now + interval_;
+
+    TraceSpan span("previewScale", sequence);
+    // A whole factor keeps cv::resize on its vectorised area-averaging path,
+    // which is much cheaper than arbitrary scales and doesn't alias.
+    uint32_t factor = std::max((width + maxWidth_ - 1) / maxWidth_, (height + maxHeight_ - 1) / maxHeight_);
+    factor = std::max(factor, 1u);
+    cv::Mat frame(height, width, CV_8UC3, const_cast<uint8_t *>(data), stride);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (factor == 1)
+        frame.copyTo(back_);
+    else
+        cv::resize(frame, back_, cv::Size(width / factor, height / factor), 0, 0, cv::INTER_AREA);
+    backSequence_ = sequence;
+    fresh_ = true;
+}
+
+void Preview::run() {
+#ifndef HEADLESS
+    pthread_setname_np(pthread_self(), "preview");
+    cv::namedWindow(title_, cv::WINDOW_NORMAL);
+    // waitKey() both paces the loop and keeps the window responsive.
+    int wait_ms = std::max<int>(interval_ / 1000000, 1);
+    bool sized = false;
+    while (running_.load(std::memory_order_relaxed)) {
+        bool fresh;
+        uint64_t sequence;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fresh = fresh_;
+            sequence = backSequence_;
+            if (fresh)
+                cv::swap(front_, back_);
+            fresh_ = false;
+        }
+        if (fresh) {
+            TraceSpan span("imshow", sequence);
+            if (!sized) {
+                cv::resizeWindow(title_, front_.cols, front_.rows);
+                sized = true;
+            }
+            cv::imshow(title_, front_);
+            shown_.fetch_add(1, std::memory_order_relaxed);
+        }
+        int key = cv::waitKey(wait_ms);
+        if (key >= 0)
+            key_.store(key, std::memory_order_relaxed);
+    }
+    cv::destroyWindow(title_);
+#endif
+}
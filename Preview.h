@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+// Shows the camera in a window without slowing capture down. offer() is
+// called with every frame and returns at once unless a preview frame is
+// due (maxFps); then it scales the frame down into the back one of two
+// buffers, so the caller's buffer is never held past that copy. A thread of
+// its own swaps the buffers, draws the front one and polls the keyboard;
+// highgui is only used from that thread.
+//
+// Built with HEADLESS defined (cmake -DHEADLESS=ON) the window is compiled
+// out, highgui isn't linked and start() returns false.
+class Preview {
+    public:
+        Preview(const std::string &title, uint32_t maxWidth = 960, uint32_t maxHeight = 540, double maxFps = 15);
+        ~Preview() { stop(); }
+
+        bool start();
+        void stop();
+
+        // A BGR (formats::RGB888) frame; see above.
+        void offer(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride, uint64_t sequence = 0);
+        // Last key pressed in the window since the previous call, -1 for none.
+        int key() { return key_.exchange(-1, std::memory_order_relaxed); }
+        uint64_t shownFrames() const { return shown_.load(std::memory_order_relaxed); }
+
+    private:
+        void run();
+
+        std::string title_;
+        uint32_t maxWidth_;
+        uint32_t maxHeight_;
+        uint64_t interval_;  // ns
+        uint64_t next_ = 0;  // when offer() copies again, only used by it
+
+        // back_ is written by offer() and swapped with front_ by run(),
+        // both under mutex_; run() draws front_ without it.
+        std::mutex mutex_;
+        cv::Mat front_;
+        cv::Mat back_;
+        uint64_t backSequence_ = 0;
+        bool fresh_ = false;
+
+        std::atomic<bool> running_{false};
+        std::atomic<int> key_{-1};
+        std::atomic<uint64_t> shown_{0};
+        std::thread thread_;
+};
@@ -0,0 +1,518 @@
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <math.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "LatencyStats.h"
+#include "SimulatedCamera.h"
+#include "Trace.h"
+
+static uint32_t alignUp(uint32_t value, uint32_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// Copies a packed BGR image into a camera-style buffer. formats::RGB888 is
+// stored B, G, R in memory, so it is a plain strided copy; YUV420 is three
+// planes (full-range BT.601) with a chroma stride of half the luma stride.
+static void packFrame(const uint8_t *bgr, uint32_t width, uint32_t height,
+                      PixelFormat format, uint32_t stride, uint8_t *out) {
+    if (format == formats::RGB888) {
+        for (uint32_t y = 0; y < height; y++)
+            memcpy(out + y * stride, bgr + y * width * 3, width * 3);
+        return;
+    }
+
+    uint8_t *Y = out;
+    uint8_t *U = Y + stride * height;
+    uint8_t *V = U + (stride / 2) * (height / 2);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *p = bgr + y * width * 3;
+        for (uint32_t x = 0; x < width; x++, p += 3) {
+            int b = p[0], g = p[1], r = p[2];
+            Y[y * stride + x] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+            if ((x & 1) || (y & 1))
+                continue;
+            int u = ((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128;
+            int v = ((128 * r - 107 * g - 21 * b + 128) >> 8) + 128;
+            U[(y / 2) * (stride / 2) + x / 2] = std::min(std::max(u, 0), 255);
+            V[(y / 2) * (stride / 2) + x / 2] = std::min(std::max(v, 0), 255);
+        }
+    }
+}
+
+// Stride and size of a frame in the layout used for every simulated buffer;
+// YUV420 dimensions are rounded down to even.
+static uint32_t layoutFrame(PixelFormat format, uint32_t &width, uint32_t &height, uint32_t &stride) {
+    if (format == formats::RGB888) {
+        stride = alignUp(width * 3, 64);
+        return stride * height;
+    }
+    width &= ~1u;
+    height &= ~1u;
+    stride = alignUp(width, 64);
+    return stride * height + 2 * (stride / 2) * (height / 2);
+}
+
+// Describes a frame laid out by layoutFrame() as libcamera would.
+static void describeFrame(StreamView &view, uint8_t *data, uint32_t offset, int fd, PixelFormat format,
+                          uint32_t width, uint32_t height, uint32_t stride) {
+    view.format = format;
+    view.width = width;
+    view.height = height;
+    if (format == formats::RGB888) {
+        view.planeCount = 1;
+        view.planes[0] = { data, offset, stride, stride * height, stride * height, fd };
+        return;
+    }
+    view.planeCount = 3;
+    for (unsigned int i = 0; i < 3; i++) {
+        uint32_t planeStride = i ? stride / 2 : stride;
+        uint32_t size = planeStride * (i ? height / 2 : height);
+        view.planes[i] = { data, offset, planeStride, size, size, fd };
+        data += size;
+        offset += size;
+    }
+}
+
+SimulatedCamera::SimulatedCamera(double fps)
+    : format_(formats::RGB888), analysisFormat_(formats::YUV420), follow_controls_(fps < 0),
+      frame_time_us_(fps > 0 ? static_cast<int64_t>(1000000 / fps) : fps < 0 ? 1000000 / 30 : 0) {
+}
+
+SimulatedCamera::~SimulatedCamera() {
+    stopCamera();
+    closeCamera();
+}
+
+int SimulatedCamera::initCamera() {
+    recordInit();
+    frame_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (frame_event_fd_ < 0) {
+        std::cerr << "Failed to create frame eventfd" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+char * SimulatedCamera::getCameraId() {
+    return cameraId_.data();
+}
+
+void SimulatedCamera::configureStill(int width, int height, PixelFormat format, int buffercount, int rotation,
+                                     int analysisWidth, int analysisHeight, PixelFormat analysisFormat) {
+    if (format != formats::RGB888 && format != formats::YUV420)
+        throw std::runtime_error("simulated camera only supports RGB888 and YUV420");
+    if (analysisWidth && analysisHeight) {
+        // The analysis stream is scaled down from the main one, which can
+        // only be done without a colour conversion back to BGR.
+        if (analysisFormat != formats::RGB888 && analysisFormat != formats::YUV420)
+            throw std::runtime_error("simulated camera only supports RGB888 and YUV420");
+        if (format == formats::YUV420 && analysisFormat != formats::YUV420)
+            throw std::runtime_error("simulated YUV420 capture needs a YUV420 analysis stream");
+    }
+    if (rotation != 0 && rotation != 180)
+        throw std::runtime_error("illegal rotation value, Please use 0 or 180");
+    if (width && height) {
+        width_ = width;
+        height_ = height;
+    }
+    format_ = format;
+    bufferCount_ = buffercount ? buffercount : 4;
+
+    frameSize_ = layoutFrame(format_, width_, height_, stride_);
+
+    analysisWidth_ = std::min<uint32_t>(std::max(analysisWidth, 0), width_);
+    analysisHeight_ = std::min<uint32_t>(std::max(analysisHeight, 0), height_);
+    analysisFormat_ = analysisFormat;
+    analysisSize_ = 0;
+    if (analysisWidth_ && analysisHeight_) {
+        analysisSize_ = layoutFrame(analysisFormat_, analysisWidth_, analysisHeight_, analysisStride_);
+        analysisBgr_.resize(analysisWidth_ * analysisHeight_ * 3);
+    }
+}
+
+int SimulatedCamera::startCamera() {
+    if (!frameSize_)
+        configureStill(width_, height_, format_, bufferCount_, 0, analysisWidth_, analysisHeight_, analysisFormat_);
+
+    int ret = prepare();
+    if (ret)
+        return ret;
+
+    // The analysis stream, if any, follows the main one in the same buffer.
+    buffers_.assign(bufferCount_, Buffer());
+    for (Buffer &buffer : buffers_) {
+        buffer.size = frameSize_ + analysisSize_;
+        buffer.fd = memfd_create("simulated-frame", MFD_CLOEXEC);
+        void *data = MAP_FAILED;
+        if (buffer.fd >= 0 && ftruncate(buffer.fd, buffer.size) == 0)
+            data = mmap(nullptr, buffer.size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "Can't allocate buffers" << std::endl;
+            freeBuffers();
+            return -ENOMEM;
+        }
+        buffer.data = static_cast<uint8_t *>(data);
+    }
+    bufferInfo_.assign(bufferCount_, BufferInfo());
+    freeBuffers_.clear();
+    for (unsigned int i = 0; i < bufferCount_; i++)
+        freeBuffers_.push_back(i);
+    requestQueue.reset(bufferCount_);
+
+    running_ = true;
+    thread_ = std::thread(&SimulatedCamera::run, this);
+    return 0;
+}
+
+void SimulatedCamera::run() {
+    pthread_setname_np(pthread_self(), "camera");
+    uint64_t sequence = 0;
+    auto next = std::chrono::steady_clock::now();
+    while (running_) {
+        int64_t frame_time = frame_time_us_.load(std::memory_order_relaxed);
+        if (frame_time > 0) {
+            auto now = std::chrono::steady_clock::now();
+            next += std::chrono::microseconds(frame_time);
+            // Don't burst to catch up after a stall, a sensor wouldn't.
+            if (next < now)
+                next = now;
+            std::this_thread::sleep_until(next);
+        }
+
+        unsigned int index;
+        {
+            std::unique_lock<std::mutex> lock(free_mutex_);
+            if (frame_time <= 0)
+                free_cv_.wait(lock, [this] { return !freeBuffers_.empty() || !running_; });
+            if (!running_)
+                break;
+            if (freeBuffers_.empty()) {
+                // Every buffer is still held by the consumer: the frame is lost.
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                sequence++;
+                continue;
+            }
+            index = freeBuffers_.back();
+            freeBuffers_.pop_back();
+        }
+
+        // Rendering stands in for the exposure and the ISP.
+        bufferInfo_[index].sequence = sequence;
+        bufferInfo_[index].timestamp = latencyClock();
+        fillFrame(buffers_[index].data, sequence++);
+        if (analysisSize_)
+            fillAnalysis(buffers_[index].data);
+        bufferInfo_[index].completed = latencyClock();
+        if (Trace::enabled())
+            Trace::complete("capture", bufferInfo_[index].timestamp, bufferInfo_[index].completed,
+                            bufferInfo_[index].sequence);
+        requestQueue.push(index);
+        uint64_t one = 1;
+        if (write(frame_event_fd_, &one, sizeof(one)) < 0)
+            std::cerr << "Failed to signal frame eventfd" << std::endl;
+    }
+}
+
+void SimulatedCamera::fillAnalysis(uint8_t *data) {
+    uint8_t *out = data + frameSize_;
+    if (format_ == formats::RGB888) {
+        // Nearest neighbour, then the same conversion a real frame gets.
+        uint8_t *p = analysisBgr_.data();
+        for (uint32_t y = 0; y < analysisHeight_; y++) {
+            const uint8_t *row = data + (y * height_ / analysisHeight_) * stride_;
+            for (uint32_t x = 0; x < analysisWidth_; x++, p += 3)
+                memcpy(p, row + (x * width_ / analysisWidth_) * 3, 3);
+        }
+        packFrame(analysisBgr_.data(), analysisWidth_, analysisHeight_, analysisFormat_, analysisStride_, out);
+        return;
+    }
+
+    StreamView src, dst;
+    describeFrame(src, data, 0, -1, format_, width_, height_, stride_);
+    describeFrame(dst, out, 0, -1, analysisFormat_, analysisWidth_, analysisHeight_, analysisStride_);
+    for (unsigned int i = 0; i < 3; i++) {
+        uint32_t shift = i ? 1 : 0;
+        uint32_t srcW = width_ >> shift, srcH = height_ >> shift;
+        uint32_t dstW = analysisWidth_ >> shift, dstH = analysisHeight_ >> shift;
+        for (uint32_t y = 0; y < dstH; y++) {
+            const uint8_t *row = src.planes[i].data + (y * srcH / dstH) * src.planes[i].stride;
+            uint8_t *q = dst.planes[i].data + y * dst.planes[i].stride;
+            for (uint32_t x = 0; x < dstW; x++)
+                q[x] = row[x * srcW / dstW];
+        }
+    }
+}
+
+bool SimulatedCamera::readFrame(LibcameraOutData *frameData) {
+    std::lock_guard<std::mutex> lock(free_requests_mutex_);
+    unsigned int index;
+    if (!requestQueue.pop(&index)) {
+        frameData->request = 0;
+        recordEmptyPoll();
+        return false;
+    }
+    uint8_t *data = buffers_[index].data;
+    int fd = buffers_[index].fd;
+    describeFrame(frameData->streams[kMainStream], data, 0, fd, format_, width_, height_, stride_);
+    frameData->streamCount = 1;
+    if (analysisSize_) {
+        describeFrame(frameData->streams[kAnalysisStream], data + frameSize_, frameSize_, fd, analysisFormat_,
+                      analysisWidth_, analysisHeight_, analysisStride_);
+        frameData->streamCount = 2;
+    }
+    frameData->imageData = data;
+    frameData->size = frameSize_;
+    frameData->sequence = bufferInfo_[index].sequence;
+    frameData->timestamp = bufferInfo_[index].timestamp;
+    frameData->completed = bufferInfo_[index].completed;
+    // Cookie 0 means "no frame", so buffer indices are stored off by one.
+    frameData->request = index + 1;
+    recordDequeue(frameData);
+    return true;
+}
+
+bool SimulatedCamera::readFrame(LibcameraOutData *frameData, int timeout_ms) {
+    return waitForFrame(frameData, frame_event_fd_, timeout_ms);
+}
+
+void SimulatedCamera::returnFrameBuffer(LibcameraOutData frameData) {
+    if (!frameData.request || frameData.request > buffers_.size())
+        return;
+    recordReturn(frameData);
+    {
+        std::lock_guard<std::mutex> lock(free_mutex_);
+        freeBuffers_.push_back(frameData.request - 1);
+    }
+    free_cv_.notify_one();
+}
+
+void SimulatedCamera::set(ControlList controls) {
+    if (!follow_controls_)
+        return;
+    auto limits = controls.get(controls::FrameDurationLimits);
+    if (limits)
+        frame_time_us_ = (*limits)[0];
+}
+
+int SimulatedCamera::resetCamera(int width, int height, PixelFormat format, int buffercount, int rotation) {
+    stopCamera();
+    configureStill(width, height, format, buffercount, rotation, analysisWidth_, analysisHeight_, analysisFormat_);
+    return startCamera();
+}
+
+void SimulatedCamera::stopCamera() {
+    {
+        std::lock_guard<std::mutex> lock(free_mutex_);
+        running_ = false;
+    }
+    free_cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+
+    unsigned int index;
+    while (requestQueue.pop(&index))
+        ;
+    uint64_t count;
+    if (frame_event_fd_ >= 0 && read(frame_event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        std::cerr << "Failed to clear frame eventfd" << std::endl;
+
+    freeBuffers_.clear();
+    freeBuffers();
+}
+
+void SimulatedCamera::freeBuffers() {
+    for (Buffer &buffer : buffers_) {
+        if (buffer.data)
+            munmap(buffer.data, buffer.size);
+        if (buffer.fd >= 0)
+            close(buffer.fd);
+    }
+    buffers_.clear();
+}
+
+void SimulatedCamera::closeCamera() {
+    if (frame_event_fd_ >= 0)
+        close(frame_event_fd_);
+    frame_event_fd_ = -1;
+}
+
+Stream *SimulatedCamera::VideoStream(uint32_t *w, uint32_t *h, uint32_t *stride) const {
+    if (w)
+        *w = width_;
+    if (h)
+        *h = height_;
+    if (stride)
+        *stride = stride_;
+    return nullptr;
+}
+
+Stream *SimulatedCamera::AnalysisStream(uint32_t *w, uint32_t *h, uint32_t *stride) const {
+    if (w)
+        *w = analysisSize_ ? analysisWidth_ : 0;
+    if (h)
+        *h = analysisSize_ ? analysisHeight_ : 0;
+    if (stride)
+        *stride = analysisSize_ ? analysisStride_ : 0;
+    return nullptr;
+}
+
+SyntheticCamera::SyntheticCamera(double fps)
+    : SimulatedCamera(fps) {
+    cameraId_ = "synthetic";
+}
+
+SyntheticCamera::~SyntheticCamera() {
+    // The producer thread calls fillFrame(), stop it while this still exists.
+    stopCamera();
+}
+
+int SyntheticCamera::prepare() {
+    const unsigned int kPatterns = 8;
+    std::vector<uint8_t> bgr(width_ * height_ * 3);
+    patterns_.assign(kPatterns, std::vector<uint8_t>(frameSize_));
+
+    for (unsigned int k = 0; k < kPatterns; k++) {
+        double phase = static_cast<double>(k) / kPatterns;
+        // Fades from full daylight to dusk and back over the cycle.
+        double light = 0.35 + 0.65 * (0.5 + 0.5 * cos(2 * M_PI * phase));
+        double sunX = phase * width_, sunY = 0.2 * height_, sunR = height_ / 10.0;
+        double cloudX = fmod(0.3 + 2 * phase, 1.0) * width_, cloudY = 0.35 * height_;
+        uint32_t horizon = height_ * 55 / 100;
+
+        for (uint32_t y = 0; y < height_; y++) {
+            uint8_t *p = bgr.data() + y * width_ * 3;
+            for (uint32_t x = 0; x < width_; x++, p += 3) {
+                double b, g, r;
+                double dx = x - sunX, dy = y - sunY;
+                double cx = (x - cloudX) / (width_ / 8.0), cy = (y - cloudY) / (height_ / 20.0);
+                if (dx * dx + dy * dy < sunR * sunR) {
+                    b = 40; g = 220; r = 240;
+                } else if (y < horizon && cx * cx + cy * cy < 1) {
+                    b = 235; g = 235; r = 235;
+                } else if (y < horizon) {
+                    double t = static_cast<double>(y) / horizon;
+                    b = 210; g = 110 + 60 * t; r = 30 + 70 * t;
+                } else if (y < horizon + height_ / 20) {
+                    b = 30; g = 70; r = 130;
+                } else {
+                    b = 40; g = 150; r = 60;
+                }
+                p[0] = b * light;
+                p[1] = g * light;
+                p[2] = r * light;
+            }
+        }
+        packFrame(bgr.data(), width_, height_, format_, stride_, patterns_[k].data());
+    }
+    return 0;
+}
+
+void SyntheticCamera::fillFrame(uint8_t *data, uint64_t sequence) {
+    const std::vector<uint8_t> &pattern = patterns_[sequence % patterns_.size()];
+    memcpy(data, pattern.data(), pattern.size());
+}
+
+ReplayCamera::ReplayCamera(const std::string &path, double fps)
+    : SimulatedCamera(fps), path_(path) {
+    cameraId_ = "replay:" + path;
+}
+
+ReplayCamera::~ReplayCamera() {
+    stopCamera();
+    if (raw_)
+        munmap(raw_, rawSize_);
+}
+
+int ReplayCamera::prepare() {
+    // Recorded frames are kept in memory so disk I/O doesn't show up in the
+    // numbers; cap how many decoded images that can be.
+    const size_t kMaxDecodedFrames = 64;
+
+    struct stat st;
+    if (stat(path_.c_str(), &st) != 0) {
+        std::cerr << "Replay source " << path_ << " not found" << std::endl;
+        return 1;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (raw_)
+            munmap(raw_, rawSize_);
+        raw_ = nullptr;
+        rawFrames_ = st.st_size / frameSize_;
+        if (!rawFrames_) {
+            std::cerr << path_ << " holds no complete " << width_ << "x" << height_
+                      << " " << format_.toString() << " frame" << std::endl;
+            return 1;
+        }
+        int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << path_ << std::endl;
+            return 1;
+        }
+        rawSize_ = rawFrames_ * frameSize_;
+        void *memory = mmap(NULL, rawSize_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            std::cerr << "Failed to map " << path_ << std::endl;
+            return 1;
+        }
+        raw_ = static_cast<uint8_t *>(memory);
+        return 0;
+    }
+
+    std::vector<std::string> files;
+    DIR *dir = opendir(path_.c_str());
+    if (!dir) {
+        std::cerr << "Failed to open " << path_ << std::endl;
+        return 1;
+    }
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        std::string ext = name.substr(name.find_last_of('.') + 1);
+        if (ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "bmp")
+            files.push_back(path_ + "/" + name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    if (files.size() > kMaxDecodedFrames)
+        files.resize(kMaxDecodedFrames);
+
+    frames_.clear();
+    for (const std::string &file : files) {
+        cv::Mat image = cv::imread(file);
+        if (image.empty()) {
+            std::cerr << "Skipping unreadable frame " << file << std::endl;
+            continue;
+        }
+        if (image.cols != static_cast<int>(width_) || image.rows != static_cast<int>(height_))
+            cv::resize(image, image, cv::Size(width_, height_));
+        if (!image.isContinuous())
+            image = image.clone();
+        frames_.emplace_back(frameSize_);
+        packFrame(image.data, width_, height_, format_, stride_, frames_.back().data());
+    }
+    if (frames_.empty()) {
+        std::cerr << "No frames to replay in " << path_ << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+void ReplayCamera::fillFrame(uint8_t *data, uint64_t sequence) {
+    if (raw_)
+        memcpy(data, raw_ + (sequence % rawFrames_) * frameSize_, frameSize_);
+    else
+        memcpy(data, frames_[sequence % frames_.size()].data(), frameSize_);
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FrameSource.h"
+#include "SpscRing.h"
+
+// Base for the camera stand-ins. It owns a fixed pool of buffercount frame
+// buffers and a producer thread that fills a free buffer once per frame
+// interval, the way a sensor would: when the consumer is holding every
+// buffer the frame is dropped. fps > 0 fixes the frame rate, fps < 0 follows
+// FrameDurationLimits like a sensor (30 fps until set) and fps == 0 produces
+// frames as fast as buffers come back, for measuring throughput.
+class SimulatedCamera : public FrameSource {
+    public:
+        SimulatedCamera(double fps);
+        ~SimulatedCamera();
+
+        int initCamera() override;
+        void configureStill(int width, int height, PixelFormat format, int buffercount, int rotation,
+                            int analysisWidth = 0, int analysisHeight = 0,
+                            PixelFormat analysisFormat = formats::YUV420) override;
+        int startCamera() override;
+        int resetCamera(int width, int height, PixelFormat format, int buffercount, int rotation) override;
+        bool readFrame(LibcameraOutData *frameData) override;
+        bool readFrame(LibcameraOutData *frameData, int timeout_ms) override;
+        void returnFrameBuffer(LibcameraOutData frameData) override;
+
+        void set(ControlList controls) override;
+        void stopCamera() override;
+        void closeCamera() override;
+
+        Stream *VideoStream(uint32_t *w, uint32_t *h, uint32_t *stride) const override;
+        Stream *AnalysisStream(uint32_t *w, uint32_t *h, uint32_t *stride) const override;
+        char * getCameraId() override;
+        size_t bufferSize() const override { return frameSize_ + analysisSize_; }
+
+        uint64_t droppedFrames() const { return dropped_.load(std::memory_order_relaxed); }
+
+    protected:
+        // Called from startCamera() once the format is known.
+        virtual int prepare() { return 0; }
+        // Called on the producer thread to render frame number sequence
+        // into the main stream (frameSize_ bytes).
+        virtual void fillFrame(uint8_t *data, uint64_t sequence) = 0;
+
+        uint32_t width_ = 1920;
+        uint32_t height_ = 1080;
+        uint32_t stride_ = 0;
+        uint32_t frameSize_ = 0;
+        PixelFormat format_;
+        std::string cameraId_;
+
+    private:
+        void run();
+        void freeBuffers();
+        // Scales the main stream of a buffer down into its analysis stream.
+        void fillAnalysis(uint8_t *data);
+
+        uint32_t analysisWidth_ = 0;
+        uint32_t analysisHeight_ = 0;
+        uint32_t analysisStride_ = 0;
+        uint32_t analysisSize_ = 0;
+        PixelFormat analysisFormat_;
+        std::vector<uint8_t> analysisBgr_;
+
+        unsigned int bufferCount_ = 4;
+        // Frame buffers live in memfds, so like dmabufs they can be passed
+        // to other processes (see FrameBus.h).
+        struct Buffer {
+            int fd = -1;
+            uint8_t *data = nullptr;
+            size_t size = 0;
+        };
+        std::vector<Buffer> buffers_;
+        // The frame in each buffer, as readFrame() reports it.
+        struct BufferInfo {
+            uint64_t sequence = 0;
+            uint64_t timestamp = 0;
+            uint64_t completed = 0;
+        };
+        std::vector<BufferInfo> bufferInfo_;
+
+        std::vector<unsigned int> freeBuffers_;
+        std::mutex free_mutex_;
+        std::condition_variable free_cv_;
+
+        SpscRing<unsigned int> requestQueue;
+        std::mutex free_requests_mutex_;
+        int frame_event_fd_ = -1;
+
+        bool follow_controls_;
+        std::atomic<int64_t> frame_time_us_;
+        std::atomic<bool> running_{false};
+        std::atomic<uint64_t> dropped_{0};
+        std::thread thread_;
+};
+
+// Renders a deterministic scene (sky, ground, a moving sun and a slow
+// day/night brightness cycle) so colour statistics change from frame to
+// frame. A handful of frames are pre-rendered so producing a frame costs
+// one memcpy.
+class SyntheticCamera : public SimulatedCamera {
+    public:
+        SyntheticCamera(double fps = -1);
+        ~SyntheticCamera();
+
+    protected:
+        int prepare() override;
+        void fillFrame(uint8_t *data, uint64_t sequence) override;
+
+    private:
+        std::vector<std::vector<uint8_t>> patterns_;
+};
+
+// Replays recorded frames in a loop. path is either a file of raw frames
+// stored back to back in the configured format and size, or a directory of
+// images (jpg/png/bmp) which are decoded and converted up front.
+class ReplayCamera : public SimulatedCamera {
+    public:
+        ReplayCamera(const std::string &path, double fps = -1);
+        ~ReplayCamera();
+
+    protected:
+        int prepare() override;
+        void fillFrame(uint8_t *data, uint64_t sequence) override;
+
+    private:
+        std::string path_;
+        std::vector<std::vector<uint8_t>> frames_;
+        uint8_t *raw_ = nullptr;
+        size_t rawSize_ = 0;
+        size_t rawFrames_ = 0;
+};
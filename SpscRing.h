@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <vector>
+
+// Bounded single-producer/single-consumer ring buffer. One thread may push()
+// while another pops, without locks. The capacity is rounded up to a power
+// of two; push() fails instead of overwriting when the ring is full.
+template <typename T>
+class SpscRing {
+    public:
+        SpscRing(size_t capacity = 0) { reset(capacity); }
+
+        // Not thread safe: only call while neither side is running.
+        void reset(size_t capacity) {
+            size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+            slots_.assign(size, T());
+            mask_ = size - 1;
+            head_.store(0, std::memory_order_relaxed);
+            tail_.store(0, std::memory_order_relaxed);
+            head_cache_ = 0;
+            tail_cache_ = 0;
+        }
+
+        // Producer side.
+        bool push(const T &item) {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_cache_ > mask_) {
+                head_cache_ = head_.load(std::memory_order_acquire);
+                if (tail - head_cache_ > mask_)
+                    return false;
+            }
+            slots_[tail & mask_] = item;
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side.
+        bool pop(T *item) {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_cache_) {
+                tail_cache_ = tail_.load(std::memory_order_acquire);
+                if (head == tail_cache_)
+                    return false;
+            }
+            *item = slots_[head & mask_];
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        size_t size() const {
+            return tail_.load(std::memory_order_acquire) -
+                   head_.load(std::memory_order_acquire);
+        }
+        bool empty() const { return size() == 0; }
+        size_t capacity() const { return mask_ + 1; }
+
+    private:
+        std::vector<T> slots_;
+        size_t mask_ = 0;
+
+        // Indices grow without wrapping; each side keeps a private copy of
+        // the other side's index so the shared line is only read when needed.
+        alignas(64) std::atomic<size_t> head_{0};
+        size_t tail_cache_ = 0;
+        alignas(64) std::atomic<size_t> tail_{0};
+        size_t head_cache_ = 0;
+};
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <math.h>
+#include <queue>
+#include <tuple>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STATS_QUERY_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define STATS_QUERY_NEON 1
+#endif
+
+#include "StatsQuery.h"
+
+// Number of values in col[0, n) greater than threshold.
+static uint64_t countAboveScalar(const uint32_t *col, uint32_t n, uint32_t threshold) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < n; i++)
+        count += col[i] > threshold;
+    return count;
+}
+
+static uint32_t columnMaxScalar(const uint32_t *col, uint32_t n) {
+    uint32_t max = 0;
+    for (uint32_t i = 0; i < n; i++)
+        max = std::max(max, col[i]);
+    return max;
+}
+
+#ifdef STATS_QUERY_X86
+__attribute__((target("avx2")))
+static uint64_t countAboveAvx2(const uint32_t *col, uint32_t n, uint32_t threshold) {
+    // No unsigned compare in AVX2: flip the sign bits and compare signed.
+    const __m256i bias = _mm256_set1_epi32(0x80000000);
+    const __m256i limit = _mm256_set1_epi32(threshold ^ 0x80000000);
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(col + i)), bias);
+        acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(v, limit));
+    }
+    uint32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    uint64_t count = 0;
+    for (uint32_t lane : lanes)
+        count += lane;
+    return count + countAboveScalar(col + i, n - i, threshold);
+}
+
+__attribute__((target("avx2")))
+static uint32_t columnMaxAvx2(const uint32_t *col, uint32_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_max_epu32(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(col + i)));
+    uint32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    return std::max(*std::max_element(lanes, lanes + 8), columnMaxScalar(col + i, n - i));
+}
+#endif
+
+#ifdef STATS_QUERY_NEON
+static uint64_t countAboveNeon(const uint32_t *col, uint32_t n, uint32_t threshold) {
+    const uint32x4_t limit = vdupq_n_u32(threshold);
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = vsubq_u32(acc, vcgtq_u32(vld1q_u32(col + i), limit));
+    return vaddvq_u32(acc) + countAboveScalar(col + i, n - i, threshold);
+}
+
+static uint32_t columnMaxNeon(const uint32_t *col, uint32_t n) {
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = vmaxq_u32(acc, vld1q_u32(col + i));
+    return std::max(vmaxvq_u32(acc), columnMaxScalar(col + i, n - i));
+}
+#endif
+
+// Integer form of "count > value" for a given pixel count: -1 when every
+// count passes, UINT32_MAX when none can.
+static int64_t countThreshold(const Threshold &threshold, uint32_t pixels) {
+    double limit = threshold.percent ? threshold.value * pixels / 100 : threshold.value;
+    if (limit < 0)
+        return -1;
+    return std::min<double>(floor(limit), UINT32_MAX);
+}
+
+static bool inRange(const TimeRange &range, int64_t timestamp) {
+    return timestamp >= range.from && timestamp <= range.to;
+}
+
+// Decided from the header alone, so delta blocks outside the range are
+// never decoded.
+static bool outside(const StatsBlockHeader &header, const TimeRange &range) {
+    return !header.rows || header.maxTimestamp < range.from || header.minTimestamp > range.to;
+}
+
+static bool covers(const TimeRange &range, const StatsBlockHeader &header) {
+    return header.minTimestamp >= range.from && header.maxTimestamp <= range.to;
+}
+
+StatsQuery::StatsQuery(const FrameStatsLog &log)
+    : log_(log) {
+#ifdef STATS_QUERY_X86
+    __builtin_cpu_init();
+    use_avx2_ = __builtin_cpu_supports("avx2");
+#endif
+}
+
+uint64_t StatsQuery::rows(const TimeRange &range) const {
+    uint64_t rows = 0;
+    for (size_t b = 0; b < log_.blockCount(); b++) {
+        const StatsBlockHeader &header = log_.blockHeader(b);
+        if (outside(header, range))
+            continue;
+        if (covers(range, header)) {
+            rows += header.rows;
+            continue;
+        }
+        FrameStatsLog::BlockView block = log_.block(b);
+        for (uint32_t i = 0; i < block.rows; i++)
+            rows += inRange(range, block.timestamp[i]);
+    }
+    return rows;
+}
+
+uint64_t StatsQuery::count(const TimeRange &range, const Threshold &threshold) const {
+    uint64_t count = 0;
+    for (size_t b = 0; b < log_.blockCount(); b++) {
+        if (outside(log_.blockHeader(b), range))
+            continue;
+        FrameStatsLog::BlockView block = log_.block(b);
+        const uint32_t *col = block.counts[threshold.colorClass];
+
+        bool inside = covers(range, log_.blockHeader(b));
+        bool uniform = true;
+        for (uint32_t i = 1; i < block.rows && uniform; i++)
+            uniform = block.pixels[i] == block.pixels[0];
+
+        if (!inside || (threshold.percent && !uniform)) {
+            for (uint32_t i = 0; i < block.rows; i++) {
+                if (inRange(range, block.timestamp[i]))
+                    count += col[i] > countThreshold(threshold, block.pixels[i]);
+            }
+            continue;
+        }
+
+        // The whole column against one integer threshold.
+        int64_t limit = countThreshold(threshold, block.pixels[0]);
+        if (limit < 0) {
+            count += block.rows;
+            continue;
+        }
+#if defined(STATS_QUERY_X86)
+        if (use_avx2_) {
+            count += countAboveAvx2(col, block.rows, limit);
+            continue;
+        }
+#elif defined(STATS_QUERY_NEON)
+        count += countAboveNeon(col, block.rows, limit);
+        continue;
+#endif
+        count += countAboveScalar(col, block.rows, limit);
+    }
+    return count;
+}
+
+std::vector<FrameStats> StatsQuery::top(const TimeRange &range, int colorClass, size_t k) const {
+    // Min-heap of (count, block, row): the weakest of the best k on top.
+    // Candidates carry their row, gathered while their block is decoded.
+    struct Candidate {
+        uint32_t count;
+        uint32_t block;
+        uint32_t row;
+        FrameStats stats;
+        bool operator>(const Candidate &other) const {
+            return std::tie(count, block, row) > std::tie(other.count, other.block, other.row);
+        }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> heap;
+    if (!k)
+        return {};
+
+    for (size_t b = 0; b < log_.blockCount(); b++) {
+        if (outside(log_.blockHeader(b), range))
+            continue;
+        FrameStatsLog::BlockView block = log_.block(b);
+        const uint32_t *col = block.counts[colorClass];
+        bool inside = covers(range, log_.blockHeader(b));
+
+        if (heap.size() == k) {
+            // Most blocks can't beat the current k-th best at all.
+            uint32_t max;
+#if defined(STATS_QUERY_X86)
+            max = use_avx2_ ? columnMaxAvx2(col, block.rows) : columnMaxScalar(col, block.rows);
+#elif defined(STATS_QUERY_NEON)
+            max = columnMaxNeon(col, block.rows);
+#else
+            max = columnMaxScalar(col, block.rows);
+#endif
+            if (max <= heap.top().count)
+                continue;
+        }
+
+        for (uint32_t i = 0; i < block.rows; i++) {
+            if (heap.size() == k && col[i] <= heap.top().count)
+                continue;
+            if (!inside && !inRange(range, block.timestamp[i]))
+                continue;
+            heap.push(Candidate{ col[i], (uint32_t)b, i, log_.row(block, i) });
+            if (heap.size() > k)
+                heap.pop();
+        }
+    }
+
+    std::vector<FrameStats> result(heap.size());
+    for (size_t i = result.size(); i-- > 0; heap.pop())
+        result[i] = heap.top().stats;
+    return result;
+}
+
+void StatsQuery::forEach(const TimeRange &range, const std::function<void(const FrameStats &)> &fn) const {
+    for (size_t b = 0; b < log_.blockCount(); b++) {
+        if (outside(log_.blockHeader(b), range))
+            continue;
+        FrameStatsLog::BlockView block = log_.block(b);
+        for (uint32_t i = 0; i < block.rows; i++) {
+            if (inRange(range, block.timestamp[i]))
+                fn(log_.row(block, i));
+        }
+    }
+}
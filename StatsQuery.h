@@ -0,0 +1,42 @@
+#pragma once
+
+#include <functional>
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+#include "FrameStatsLog.h"
+
+// Inclusive range of FrameStats::timestamp values (microseconds).
+struct TimeRange {
+    int64_t from = std::numeric_limits<int64_t>::min();
+    int64_t to = std::numeric_limits<int64_t>::max();
+};
+
+// "count > value", value either a pixel count or a percentage of the
+// analysed pixels.
+struct Threshold {
+    int colorClass;
+    double value;
+    bool percent;
+};
+
+// Queries over a mapped FrameStatsLog. Block headers act as the time index:
+// blocks outside the range are skipped without reading their columns and
+// blocks entirely inside it are scanned a column at a time (AVX2 or NEON
+// where available); only blocks straddling an end of the range are checked
+// row by row.
+class StatsQuery {
+    public:
+        StatsQuery(const FrameStatsLog &log);
+
+        uint64_t rows(const TimeRange &range) const;
+        uint64_t count(const TimeRange &range, const Threshold &threshold) const;
+        // The k rows with the highest count of colorClass, highest first.
+        std::vector<FrameStats> top(const TimeRange &range, int colorClass, size_t k) const;
+        void forEach(const TimeRange &range, const std::function<void(const FrameStats &)> &fn) const;
+
+    private:
+        const FrameStatsLog &log_;
+        bool use_avx2_ = false;
+};
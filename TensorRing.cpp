@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <opencv2/imgproc.hpp>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "TensorRing.h"
+#include "Trace.h"
+
+namespace {
+
+struct RingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t height;
+    uint32_t width;
+    uint32_t channels;
+    uint32_t type;
+    uint32_t slotSize;
+    uint32_t dataOffset;
+    std::atomic<uint64_t> published;
+};
+
+struct SlotHeader {
+    std::atomic<uint64_t> sequence;
+    uint64_t frameID;
+    uint64_t timestamp;
+    double score;
+    uint32_t tag;
+};
+
+static_assert(offsetof(RingHeader, published) == 40, "header layout is shared with space_hawks.py");
+static_assert(sizeof(SlotHeader) <= 64, "slot header must fit before the tensor");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "counters are read by another process");
+
+constexpr uint32_t kDataOffset = 4096;
+constexpr uint32_t kSlotHeaderSize = 64;
+
+} // namespace
+
+int TensorRing::open(const std::string &name, unsigned int slots, uint32_t size, TensorType type) {
+    close();
+    uint32_t tensorBytes = size * size * 3 * (type == kTensorFloat32 ? sizeof(float) : 1);
+    slotSize_ = kSlotHeaderSize + ((tensorBytes + 63) & ~63u);
+    mapSize_ = kDataOffset + static_cast<size_t>(slotSize_) * slots;
+
+    std::string path = "/" + name;
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int ret = -errno;
+        std::cerr << "Failed to create shared memory " << path << ": " << strerror(errno) << std::endl;
+        return ret;
+    }
+    if (ftruncate(fd, mapSize_) < 0) {
+        int ret = -errno;
+        std::cerr << "Failed to size shared memory " << path << ": " << strerror(errno) << std::endl;
+        ::close(fd);
+        shm_unlink(path.c_str());
+        return ret;
+    }
+    void *map = mmap(nullptr, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        int ret = -errno;
+        std::cerr << "Failed to map shared memory " << path << ": " << strerror(errno) << std::endl;
+        shm_unlink(path.c_str());
+        return ret;
+    }
+
+    name_ = name;
+    map_ = static_cast<uint8_t *>(map);
+    slots_ = slots;
+    size_ = size;
+    type_ = type;
+    dataOffset_ = kDataOffset;
+
+    // The file starts zeroed, so no slot looks complete. The magic goes in
+    // last, once the rest of the header can be trusted.
+    RingHeader *header = reinterpret_cast<RingHeader *>(map_);
+    header->version = 1;
+    header->slots = slots;
+    header->height = size;
+    header->width = size;
+    header->channels = 3;
+    header->type = type;
+    header->slotSize = slotSize_;
+    header->dataOffset = dataOffset_;
+    header->published.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, "TNSRING1", 8);
+    return 0;
+}
+
+void TensorRing::close() {
+    if (!map_)
+        return;
+    munmap(map_, mapSize_);
+    map_ = nullptr;
+    shm_unlink(("/" + name_).c_str());
+}
+
+uint64_t TensorRing::published() const {
+    if (!map_)
+        return 0;
+    return reinterpret_cast<const RingHeader *>(map_)->published.load(std::memory_order_relaxed);
+}
+
+void TensorRing::publish(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride, uint64_t frameID,
+                         uint64_t timestamp, double score, uint32_t tag) {
+    if (!map_)
+        return;
+    TraceSpan span("tensorPublish", frameID);
+    RingHeader *header = reinterpret_cast<RingHeader *>(map_);
+    uint64_t n = header->published.load(std::memory_order_relaxed);
+    uint8_t *base = map_ + dataOffset_ + static_cast<size_t>(n % slots_) * slotSize_;
+    SlotHeader *slot = reinterpret_cast<SlotHeader *>(base);
+    slot->sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // Same steps as space_hawks.py's read_inference_image(): centre crop,
+    // bilinear resize, BGR to RGB and, for float, / 255. The crop is only
+    // a view; the resize reads the camera buffer directly and the last
+    // step writes into shared memory, all on OpenCV's vectorised paths.
+    cv::Mat frame(height, width, CV_8UC3, const_cast<uint8_t *>(data), stride);
+    uint32_t side = std::min(width, height);
+    cv::Mat square = frame(cv::Rect((width - side) / 2, (height - side) / 2, side, side));
+    cv::resize(square, scaled_, cv::Size(size_, size_), 0, 0, cv::INTER_LINEAR);
+    uint8_t *tensor = base + kSlotHeaderSize;
+    if (type_ == kTensorFloat32) {
+        cv::cvtColor(scaled_, rgb_, cv::COLOR_BGR2RGB);
+        cv::Mat out(size_, size_, CV_32FC3, tensor);
+        rgb_.convertTo(out, CV_32FC3, 1.0 / 255);
+    } else {
+        cv::Mat out(size_, size_, CV_8UC3, tensor);
+        cv::cvtColor(scaled_, out, cv::COLOR_BGR2RGB);
+    }
+
+    slot->frameID = frameID;
+    slot->timestamp = timestamp;
+    slot->score = score;
+    slot->tag = tag;
+    slot->sequence.store(n + 1, std::memory_order_release);
+    header->published.store(n + 1, std::memory_order_release);
+}
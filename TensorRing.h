@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+// Hands preprocessed model inputs to another process (space_hawks.py)
+// through a ring of slots in POSIX shared memory, /dev/shm/<name>, which
+// the reader maps and wraps in numpy arrays without copying. Each tensor is
+// the frame centre-cropped to a square, scaled to size x size and stored
+// as HWC RGB, either uint8 or float32 in 0-1: what space_hawks.py used to
+// do to the JPEGs itself.
+//
+// Layout (little endian, offsets in bytes):
+//   0   char magic[8] "TNSRING1"
+//   8   u32 version (1), slots, height, width, channels, type, slotSize,
+//       dataOffset
+//   40  u64 published: tensors written so far
+//   dataOffset + i * slotSize: slot i, holding tensor n = i mod slots:
+//     0   u64 sequence: n + 1 once complete, 0 while being written
+//     8   u64 frameID, u64 timestamp (ns), f64 score, u32 tag
+//     64  the tensor
+// A reader takes tensor published - 1 (or the one after the last it used),
+// and checks that its slot's sequence is n + 1 before and after reading.
+// If not, the writer has lapped it and the tensor is gone.
+enum TensorType { kTensorUint8 = 0, kTensorFloat32 = 1 };
+
+class TensorRing {
+    public:
+        TensorRing(){};
+        ~TensorRing() { close(); }
+        TensorRing(const TensorRing &) = delete;
+        TensorRing &operator=(const TensorRing &) = delete;
+
+        // Creates (or replaces) /dev/shm/<name>. Returns 0 or -errno.
+        int open(const std::string &name, unsigned int slots, uint32_t size, TensorType type);
+        // Unmaps and removes the ring; readers keep their mapping.
+        void close();
+
+        // Preprocesses a BGR (formats::RGB888) frame straight into the next
+        // slot. One writer only.
+        void publish(const uint8_t *data, uint32_t width, uint32_t height, uint32_t stride, uint64_t frameID,
+                     uint64_t timestamp, double score, uint32_t tag);
+
+        bool isOpen() const { return map_ != nullptr; }
+        uint64_t published() const;
+
+    private:
+        std::string name_;
+        uint8_t *map_ = nullptr;
+        size_t mapSize_ = 0;
+        unsigned int slots_ = 0;
+        uint32_t size_ = 0;
+        TensorType type_ = kTensorUint8;
+        uint32_t slotSize_ = 0;
+        uint32_t dataOffset_ = 0;
+        cv::Mat scaled_;
+        cv::Mat rgb_;
+};
@@ -0,0 +1,52 @@
+#include <algorithm>
+#include <string.h>
+
+#include "TopKSelector.h"
+
+TopKSelector::TopKSelector(size_t k, uint32_t rowBytes, uint32_t height)
+    : k_(k), rowBytes_(rowBytes), height_(height),
+      frameBytes_(static_cast<size_t>(rowBytes) * height),
+      pool_(k * frameBytes_), slots_(k) {
+    heap_.reserve(k);
+}
+
+bool TopKSelector::worse(size_t a, size_t b) const {
+    // Comparator for std::*_heap: "greater" puts the lowest score on top.
+    return slots_[a].score > slots_[b].score;
+}
+
+bool TopKSelector::offer(double score, int frameID, const uint8_t *data, uint32_t stride) {
+    auto cmp = [this](size_t a, size_t b) { return worse(a, b); };
+    size_t slot;
+    if (heap_.size() < k_) {
+        slot = heap_.size();
+    } else if (k_ && score > slots_[heap_.front()].score) {
+        std::pop_heap(heap_.begin(), heap_.end(), cmp);
+        slot = heap_.back();
+        heap_.pop_back();
+    } else {
+        return false;
+    }
+
+    uint8_t *dst = pool_.data() + slot * frameBytes_;
+    if (stride == rowBytes_) {
+        memcpy(dst, data, frameBytes_);
+    } else {
+        for (uint32_t y = 0; y < height_; y++)
+            memcpy(dst + y * rowBytes_, data + y * stride, rowBytes_);
+    }
+    slots_[slot] = { score, frameID };
+    heap_.push_back(slot);
+    std::push_heap(heap_.begin(), heap_.end(), cmp);
+    return true;
+}
+
+std::vector<TopKSelector::Entry> TopKSelector::winners() const {
+    std::vector<Entry> entries;
+    for (size_t slot : heap_)
+        entries.push_back({ slots_[slot].score, slots_[slot].frameID, pool_.data() + slot * frameBytes_ });
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.score > b.score;
+    });
+    return entries;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Online top-K frame selection. Keeps copies of the K highest scoring
+// frames seen so far in a pool allocated up front, using a min-heap so each
+// offer() is O(log K) plus one frame copy when the frame makes the cut.
+// Nothing is written anywhere until the caller asks for the winners.
+class TopKSelector {
+    public:
+        struct Entry {
+            double score;
+            int frameID;
+            const uint8_t *data; // rowBytes() per row, no padding
+        };
+
+        // rowBytes is the useful width of a row in bytes (width * 3 for RGB888).
+        TopKSelector(size_t k, uint32_t rowBytes, uint32_t height);
+
+        // Copies the frame in if it beats the current K-th best. Returns
+        // whether it was kept.
+        bool offer(double score, int frameID, const uint8_t *data, uint32_t stride);
+
+        // Kept frames, best first. Pointers stay valid until the next offer().
+        std::vector<Entry> winners() const;
+
+        size_t size() const { return heap_.size(); }
+        uint32_t rowBytes() const { return rowBytes_; }
+        uint32_t height() const { return height_; }
+
+    private:
+        struct Slot {
+            double score;
+            int frameID;
+        };
+
+        bool worse(size_t a, size_t b) const;
+
+        size_t k_;
+        uint32_t rowBytes_;
+        uint32_t height_;
+        size_t frameBytes_;
+        std::vector<uint8_t> pool_;
+        std::vector<Slot> slots_;
+        // Slot indices, worst score at the front.
+        std::vector<size_t> heap_;
+};
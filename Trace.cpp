@@ -0,0 +1,110 @@
+#include <errno.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Trace.h"
+
+std::atomic<bool> Trace::enabled_{false};
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    uint64_t begin;
+    uint64_t duration;
+    int64_t frame;
+    bool instant;
+};
+
+struct TraceBuffer {
+    TraceEvent events[kTraceEventsPerThread];
+    // Written by the owning thread only; released so write() sees whole
+    // events up to it.
+    std::atomic<uint64_t> next{0};
+    pid_t tid;
+    char name[16];
+};
+
+static_assert((kTraceEventsPerThread & (kTraceEventsPerThread - 1)) == 0, "ring size must be a power of two");
+
+// Buffers are never freed, so events of threads that have exited can still
+// be written out.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> registry;
+thread_local TraceBuffer *local_buffer = nullptr;
+
+TraceBuffer *threadBuffer() {
+    if (!local_buffer) {
+        std::unique_ptr<TraceBuffer> buffer(new TraceBuffer);
+        buffer->tid = syscall(SYS_gettid);
+        if (pthread_getname_np(pthread_self(), buffer->name, sizeof(buffer->name)))
+            snprintf(buffer->name, sizeof(buffer->name), "%d", buffer->tid);
+        local_buffer = buffer.get();
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(std::move(buffer));
+    }
+    return local_buffer;
+}
+
+void record(const TraceEvent &event) {
+    TraceBuffer *buffer = threadBuffer();
+    uint64_t next = buffer->next.load(std::memory_order_relaxed);
+    buffer->events[next & (kTraceEventsPerThread - 1)] = event;
+    buffer->next.store(next + 1, std::memory_order_release);
+}
+
+} // namespace
+
+void Trace::complete(const char *name, uint64_t begin, uint64_t end, int64_t frame) {
+    record(TraceEvent{ name, begin, end > begin ? end - begin : 0, frame, false });
+}
+
+void Trace::instant(const char *name, int64_t frame) {
+    if (enabled())
+        record(TraceEvent{ name, latencyClock(), 0, frame, true });
+}
+
+int Trace::write(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+        return -errno;
+    }
+    int pid = getpid();
+    const char *separator = "";
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (const std::unique_ptr<TraceBuffer> &buffer : registry) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, pid, buffer->tid, buffer->name);
+        separator = ",\n";
+        uint64_t end = buffer->next.load(std::memory_order_acquire);
+        uint64_t begin = end > kTraceEventsPerThread ? end - kTraceEventsPerThread : 0;
+        for (uint64_t i = begin; i < end; i++) {
+            const TraceEvent &e = buffer->events[i & (kTraceEventsPerThread - 1)];
+            // Trace-event times are microseconds.
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ts\":%.3f,", e.name, e.begin / 1e3);
+            if (e.instant)
+                fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",");
+            else
+                fprintf(fp, "\"ph\":\"X\",\"dur\":%.3f,", e.duration / 1e3);
+            fprintf(fp, "\"pid\":%d,\"tid\":%d", pid, buffer->tid);
+            if (e.frame >= 0)
+                fprintf(fp, ",\"args\":{\"frame\":%lld}", (long long)e.frame);
+            fprintf(fp, "}");
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp)) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return -EIO;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+#include "LatencyStats.h"
+
+// Timeline tracing for chrome://tracing and ui.perfetto.dev. Each thread
+// records into a ring of its own (the last kTraceEventsPerThread events),
+// so recording takes no lock once the thread's ring exists; while tracing
+// is off a span costs one relaxed load. Times are latencyClock(), the same
+// clock as frame timestamps.
+//
+// Event names must be string literals (or otherwise outlive the trace):
+// only the pointer is stored.
+constexpr size_t kTraceEventsPerThread = 1 << 15;
+
+class Trace {
+    public:
+        static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+        static void start() { enabled_.store(true, std::memory_order_relaxed); }
+        static void stop() { enabled_.store(false, std::memory_order_relaxed); }
+
+        // frame < 0 for events that don't belong to a frame.
+        static void complete(const char *name, uint64_t begin, uint64_t end, int64_t frame = -1);
+        static void instant(const char *name, int64_t frame = -1);
+
+        // Writes every thread's ring as Chrome trace-event JSON. Events
+        // recorded while this runs may be torn, so stop() first.
+        static int write(const std::string &path);
+
+    private:
+        static std::atomic<bool> enabled_;
+};
+
+// Records the time from construction to destruction as a span.
+class TraceSpan {
+    public:
+        TraceSpan(const char *name, int64_t frame = -1)
+            : name_(name), frame_(frame), begin_(Trace::enabled() ? latencyClock() : 0) {}
+        ~TraceSpan() {
+            if (begin_)
+                Trace::complete(name_, begin_, latencyClock(), frame_);
+        }
+        TraceSpan(const TraceSpan &) = delete;
+        TraceSpan &operator=(const TraceSpan &) = delete;
+
+        // For spans that only learn their frame on the way.
+        void setFrame(int64_t frame) { frame_ = frame; }
+
+    private:
+        const char *name_;
+        int64_t frame_;
+        uint64_t begin_;
+};
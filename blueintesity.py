@@ -1,7 +1,66 @@
 import cv2
+import mmap
 import numpy as np
+import os
+import socket
+import struct
+import sys
 import time
 
+# Message layouts of FrameBus.h
+BUS_BUFFER, BUS_FRAME, BUS_RELEASE, BUS_RESET = 1, 2, 3, 4
+BUS_BUFFER_MSG = struct.Struct("=15I")
+BUS_FRAME_MSG = struct.Struct("=IIQQQ4I")
+BUS_RELEASE_MSG = struct.Struct("=IIQ")
+
+class FrameBus:
+    """Frames shared by libcamera-demo --bus=PATH, without copying them."""
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.connect(path)
+        self.buffers = {}
+        self.maps = {}
+
+    def read(self):
+        """Returns (id, frame), frame being a BGR view of the camera buffer
+        that stays valid until release(id), or (None, None) once the bus is
+        gone."""
+        while True:
+            data, fds, _, _ = socket.recv_fds(self.sock, BUS_BUFFER_MSG.size, 3)
+            try:
+                if not data:
+                    return None, None
+                kind = struct.unpack_from("=I", data)[0]
+                if kind == BUS_BUFFER and fds:
+                    _, index, fourcc, width, height, planes, offset, stride, length = BUS_BUFFER_MSG.unpack(data)[:9]
+                    if struct.pack("=I", fourcc) != b"RG24":
+                        raise ValueError("frame bus format must be RGB888")
+                    memory = mmap.mmap(fds[0], offset + length, prot=mmap.PROT_READ)
+                    rows = np.frombuffer(memory, np.uint8, stride * height, offset).reshape(height, stride)
+                    self.buffers[index] = rows[:, :width * 3].reshape(height, width, 3)
+                    self.maps[index] = memory
+                elif kind == BUS_FRAME:
+                    _, index, frame_id = BUS_FRAME_MSG.unpack(data)[:3]
+                    if index in self.buffers:
+                        return frame_id, self.buffers[index]
+                    self.release(frame_id)
+                elif kind == BUS_RESET:
+                    # Unmap the old buffers now; one a frame from it is still
+                    # held in goes when that frame is dropped.
+                    self.buffers.clear()
+                    for memory in self.maps.values():
+                        try:
+                            memory.close()
+                        except BufferError:
+                            pass
+                    self.maps.clear()
+            finally:
+                for fd in fds:
+                    os.close(fd)
+
+    def release(self, frame_id):
+        self.sock.send(BUS_RELEASE_MSG.pack(BUS_RELEASE, 0, frame_id))
+
 def calculate_blue_intensity(image):
     """Calculate the blue intensity of the image."""
     blue_channel = image[:, :, 0]
@@ -10,11 +69,18 @@ def calculate_blue_intensity(image):
 def main():
     # Initialize variables
     top_frames = [(None, -1.0) for _ in range(5)]  # (image, blue_sum)
-    cap = cv2.VideoCapture(0)  # Change to your camera source if necessary
 
-    if not cap.isOpened():
-        print("Error: Could not open camera.")
-        return
+    # With --bus PATH, read the frames libcamera-demo --bus=PATH shares
+    # instead of opening the camera, which it already has
+    bus = None
+    if len(sys.argv) > 2 and sys.argv[1] == "--bus":
+        bus = FrameBus(sys.argv[2])
+        cap = None
+    else:
+        cap = cv2.VideoCapture(0)  # Change to your camera source if necessary
+        if not cap.isOpened():
+            print("Error: Could not open camera.")
+            return
 
     start_time = time.time()
     while True:
@@ -22,10 +88,17 @@ def main():
         if (current_time - start_time) >= 30:
             break  # Exit loop after 30 seconds
 
-        ret, frame = cap.read()
-        if not ret:
-            print("Error: Could not read frame.")
-            continue
+        frame_id = None
+        if bus:
+            frame_id, frame = bus.read()
+            if frame is None:
+                print("Frame bus closed.")
+                break
+        else:
+            ret, frame = cap.read()
+            if not ret:
+                print("Error: Could not read frame.")
+                continue
 
         blue_sum = calculate_blue_intensity(frame)
 
@@ -34,14 +107,18 @@ def main():
 
         # Replace the frame if the new blue_sum is larger
         if blue_sum > top_frames[min_index][1]:
-            top_frames[min_index] = (frame, blue_sum)
+            # A bus frame is the camera's buffer, so keep a copy
+            top_frames[min_index] = (frame.copy() if bus else frame, blue_sum)
 
         # Display the frame
         cv2.imshow("Camera Feed", frame)
+        if bus:
+            bus.release(frame_id)
         if cv2.waitKey(1) & 0xFF == ord('q'):
             break
 
-    cap.release()
+    if cap:
+        cap.release()
     cv2.destroyAllWindows()
 
     # Save the top 5 frames with the highest blue content as jpg
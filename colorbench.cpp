@@ -0,0 +1,150 @@
+#include <opencv2/opencv.hpp>
+#include <chrono>
+#include <errno.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "ColorClassifier.h"
+#include "ColorLut.h"
+#include "Frame.h"
+#include "SimulatedCamera.h"
+
+using namespace cv;
+
+// Compares the colour statistics implementations on the same frames:
+// the original cvtColor + inRange + countNonZero sequence, the fused
+// ColorClassifier and the quantised ColorLut tables. Frames come from the
+// synthetic camera, or from --replay=<path> (raw dump or image directory).
+//
+//   colorbench [--replay=<path>] [frames] [width height]
+
+struct Method {
+    std::string name;
+    std::function<void(const Mat &, uint32_t *)> run;
+    double total_ms = 0;
+    uint64_t abs_error[kColorClasses] = {};
+    int exact_frames = 0;
+};
+
+static void opencvCounts(const Mat &image, uint32_t *counts) {
+    Mat hsv, mask;
+    cvtColor(image, hsv, COLOR_BGR2HSV);
+    for (int c = 0; c < kColorClasses; c++) {
+        const ColorRange &range = kColorRanges[c];
+        inRange(hsv, Scalar(range.lower[0], range.lower[1], range.lower[2]),
+                Scalar(range.upper[0], range.upper[1], range.upper[2]), mask);
+        counts[c] = countNonZero(mask);
+    }
+}
+
+// All of text as a number within [min, max]
+static bool parseNumber(const std::string &text, long min, long max, long *value) {
+    char *end;
+    errno = 0;
+    long number = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end || errno || number < min || number > max)
+        return false;
+    *value = number;
+    return true;
+}
+
+static int usage() {
+    std::cerr << "Usage: colorbench [--replay=<path>] [frames] [width height]" << std::endl;
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int frames = 50;
+    int width = 1920, height = 1080;
+    std::unique_ptr<FrameSource> source;
+    std::vector<int> numbers;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        long value;
+        if (arg.rfind("--replay=", 0) == 0) {
+            source = std::make_unique<ReplayCamera>(arg.substr(9), 0);
+        } else {
+            // A frame count, then the frame size
+            if (!parseNumber(arg, 1L, numbers.empty() ? 1000000L : 16384L, &value))
+                return usage();
+            numbers.push_back(value);
+        }
+    }
+    if (numbers.size() == 2 || numbers.size() > 3)
+        return usage();
+    if (numbers.size() > 0)
+        frames = numbers[0];
+    if (numbers.size() > 2) {
+        width = numbers[1];
+        height = numbers[2];
+    }
+    if (!source)
+        source = std::make_unique<SyntheticCamera>(0);
+
+    ColorClassifier classifier;
+    auto build_start = std::chrono::steady_clock::now();
+    ColorLut lut5(5), lut6(6);
+    std::chrono::duration<double, std::milli> build = std::chrono::steady_clock::now() - build_start;
+    std::cout << "Built 5 and 6 bit colour tables in " << build.count() << " ms" << std::endl;
+
+    std::vector<Method> methods = {
+        { "opencv", opencvCounts },
+        { "fused", [&](const Mat &im, uint32_t *counts) { classifier.classify(im.data, im.cols, im.rows, im.step, counts); } },
+        { "lut5", [&](const Mat &im, uint32_t *counts) { lut5.classify(im.data, im.cols, im.rows, im.step, counts); } },
+        { "lut6", [&](const Mat &im, uint32_t *counts) { lut6.classify(im.data, im.cols, im.rows, im.step, counts); } },
+    };
+
+    if (source->initCamera())
+        return 1;
+    source->configureStill(width, height, formats::RGB888, 2, 0);
+    if (source->startCamera())
+        return 1;
+    uint32_t w, h, stride;
+    source->VideoStream(&w, &h, &stride);
+
+    uint64_t pixels = 0;
+    for (int n = 0; n < frames; n++) {
+        Frame frame = source->nextFrame(1000);
+        if (!frame) {
+            std::cerr << "Timed out waiting for frame" << std::endl;
+            break;
+        }
+        Mat im(h, w, CV_8UC3, frame.imageData(), stride);
+        pixels += w * h;
+
+        uint32_t reference[kColorClasses];
+        for (Method &method : methods) {
+            uint32_t counts[kColorClasses];
+            auto start = std::chrono::steady_clock::now();
+            method.run(im, counts);
+            method.total_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (&method == &methods[0])
+                std::copy(counts, counts + kColorClasses, reference);
+            bool exact = true;
+            for (int c = 0; c < kColorClasses; c++) {
+                method.abs_error[c] += std::abs(static_cast<int64_t>(counts[c]) - reference[c]);
+                exact &= counts[c] == reference[c];
+            }
+            method.exact_frames += exact;
+        }
+    }
+    source->stopCamera();
+    source->closeCamera();
+
+    int done = pixels / (static_cast<uint64_t>(w) * h);
+    if (!done)
+        return 1;
+    std::cout << done << " frames of " << w << "x" << h << " from " << source->getCameraId() << std::endl;
+    for (const Method &method : methods) {
+        printf("%-7s %8.2f ms/frame %8.1f Mpix/s  exact %d/%d  mean error %%:", method.name.c_str(),
+               method.total_ms / done, pixels / (method.total_ms * 1000), method.exact_frames, done);
+        for (int c = 0; c < kColorClasses; c++)
+            printf(" %s %.3f", kColorRanges[c].name, 100.0 * method.abs_error[c] / pixels);
+        printf("\n");
+    }
+    return 0;
+}
@@ -1,64 +1,43 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <cstring>
 #include <ctime>
 
-// Struct to hold frame data (same as defined in the main program)
-struct FrameData {
-    int frameID;
-    int blueCount;
-    int greenCount;
-    int yellowCount;
-    int blackCount;
-    int whiteCount;   // New field for white pixels
-    int brownCount;   // New field for brown pixels
-    double bluePercentage;    // Percentage of blue pixels
-    double greenPercentage;   // Percentage of green pixels
-    double yellowPercentage;  // Percentage of yellow pixels
-    double blackPercentage;   // Percentage of black pixels
-    double whitePercentage;   // Percentage of white pixels
-    double brownPercentage;   // Percentage of brown pixels
-    time_t timestamp;  // Timestamp for the frame
-    char filename[50]; // Filename for saving the image
-};
+#include "FrameStatsLog.h"
 
-// Function to read frame data from a binary file
-std::vector<FrameData> readFrameData(const std::string& filename) {
-    std::vector<FrameData> frames;
-    std::ifstream file(filename, std::ios::binary);
-    
-    if (!file.is_open()) {
+// Function to read frame data from a statistics log
+std::vector<FrameStats> readFrameData(const std::string& filename) {
+    std::vector<FrameStats> frames;
+    FrameStatsLog log;
+    if (log.open(filename)) {
         std::cerr << "Error: Unable to open file for reading." << std::endl;
         return frames;
     }
 
-    FrameData data;
-    while (file.read(reinterpret_cast<char*>(&data), sizeof(FrameData))) {
-        frames.push_back(data);
+    frames.reserve(log.rows());
+    for (size_t b = 0; b < log.blockCount(); b++) {
+        FrameStatsLog::BlockView block = log.block(b);
+        for (uint32_t i = 0; i < block.rows; i++)
+            frames.push_back(log.row(block, i));
     }
-
-    file.close();
     return frames;
 }
 
-int main() {
-    const std::string binaryFile = "frame_data.bin"; // Binary file for frame data
+int main(int argc, char* argv[]) {
+    const std::string binaryFile = argc > 1 ? argv[1] : "frame_stats.bin"; // Binary file for frame data
 
     // Read frame data
-    std::vector<FrameData> frameDataList = readFrameData(binaryFile);
+    std::vector<FrameStats> frameDataList = readFrameData(binaryFile);
 
     // Print the frame data
     for (const auto& frame : frameDataList) {
         std::cout << "Frame ID: " << frame.frameID << std::endl;
-        std::cout << "Timestamp: " << frame.timestamp << std::endl;
-        std::cout << "Blue Count: " << frame.blueCount << " (" << frame.bluePercentage << "%)" << std::endl;
-        std::cout << "Green Count: " << frame.greenCount << " (" << frame.greenPercentage << "%)" << std::endl;
-        std::cout << "Yellow Count: " << frame.yellowCount << " (" << frame.yellowPercentage << "%)" << std::endl;
-        std::cout << "Black Count: " << frame.blackCount << " (" << frame.blackPercentage << "%)" << std::endl;
-        std::cout << "White Count: " << frame.whiteCount << " (" << frame.whitePercentage << "%)" << std::endl;
-        std::cout << "Brown Count: " << frame.brownCount << " (" << frame.brownPercentage << "%)" << std::endl;
-        std::cout << "Filename: " << frame.filename << std::endl;
+        std::cout << "Timestamp: " << frame.timestamp / 1000000 << std::endl;
+        for (int c = 0; c < kColorClasses; c++) {
+            double percentage = frame.pixels ? 100.0 * frame.counts[c] / frame.pixels : 0;
+            std::cout << kColorRanges[c].name << " count: " << frame.counts[c] << " (" << percentage << "%)" << std::endl;
+        }
+        std::cout << "Filename: " << statsFilename(frame.frameID) << std::endl;
         std::cout << "-----------------------------" << std::endl;
     }
 
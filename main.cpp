@@ -1,93 +1,98 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/core.hpp>
-#include <opencv2/highgui.hpp>
 #include "LibCamera.h" // Ensure to include your LibCamera header
-#include <fstream>
+#include "SimulatedCamera.h"
+#include "ColorClassifier.h"
+#include "ColorLut.h"
+#include "EventRecorder.h"
+#include "TopKSelector.h"
+#include "JpegEncoder.h"
+#include "Pipeline.h"
+#include "Frame.h"
+#include "FrameBus.h"
+#include "FrameRateController.h"
+#include "FrameStatsLog.h"
+#include "LatencyStats.h"
+#include "MetricsServer.h"
+#include "Preview.h"
+#include "TensorRing.h"
+#include "Trace.h"
+#include <sstream>
 #include <vector>
 #include <algorithm>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 
 using namespace cv;
 
-// Struct to hold frame data
-struct FrameData {
-    int frameID;
-    int blueCount;
-    int greenCount;
-    int yellowCount;
-    int blackCount;
-    int whiteCount;
-    int brownCount;
-    int bluePercentage;
-    int greenPercentage;
-    int yellowPercentage;
-    int blackPercentage;
-    int whitePercentage;
-    int brownPercentage;
-    time_t timestamp;
-    char filename[50];
+// A camera frame on its way through the pipeline, with what has been
+// worked out about it so far. The buffer goes back to the camera when the
+// last stage drops its reference.
+struct CapturedFrame {
+    Frame frame;
+    FrameStats stats;
+    // Set by analysis when the frame makes the day (bit 0) or night (bit 1)
+    // top frames so far, with the better of the two scores.
+    uint32_t winner = 0;
+    double score = 0;
 };
+typedef std::shared_ptr<CapturedFrame> FramePtr;
+
+// Looks a class up by name in kColorRanges, -1 if unknown
+int colorClassByName(const std::string& name) {
+    for (int c = 0; c < kColorClasses; c++)
+        if (name == kColorRanges[c].name)
+            return c;
+    return -1;
+}
 
-// Function to save frame data to a binary file
-void saveFrameData(const std::vector<FrameData>& frames, const std::string& filename) {
-    std::ofstream file(filename, std::ios::binary);
-    if (file.is_open()) {
-        for (const auto& frame : frames) {
-            file.write(reinterpret_cast<const char*>(&frame), sizeof(FrameData));
-        }
-        file.close();
-    } else {
-        std::cerr << "Error: Unable to open file for writing." << std::endl;
+// Encode the kept frames of a selector into folder
+void saveTopFrames(JpegEncoderPool& encoder, const TopKSelector& selector, uint32_t width, const std::string& folder, const std::string& colorName) {
+    std::vector<TopKSelector::Entry> winners = selector.winners();
+    for (size_t i = 0; i < winners.size(); ++i) {
+        std::string newFilename = folder + "/top_" + colorName + "_frame_" + std::to_string(i + 1) + ".jpg";
+        encoder.submit(JpegInput::fromFrame(winners[i].data, formats::RGB888, width, selector.height(), selector.rowBytes()),
+                       newFilename, nullptr);
     }
+    encoder.wait();
 }
 
-// Function to calculate color intensity
-void calculateColorIntensity(const Mat& image, FrameData& data) {
-    // Convert to HSV for color analysis
-    Mat hsv;
-    cvtColor(image, hsv, COLOR_BGR2HSV);
+// Approximate table-driven counts instead of exact ones (--color-lut=5|6)
+static std::unique_ptr<ColorLut> colorLut;
 
-    // Define color ranges in HSV
-    int lower_blue[] = {110, 50, 70};
-    int upper_blue[] = {130, 255, 255};
-    int lower_green[] = {36, 25, 25};
-    int upper_green[] = {70, 255, 255};
-    int lower_yellow[] = {20, 100, 100};
-    int upper_yellow[] = {30, 255, 255};
-    int lower_black[] = {0, 0, 0};
-    int upper_black[] = {180, 255, 80};
-    int lower_white[] = {0, 0, 200};
-    int upper_white[] = {180, 20, 255};
-    int lower_brown[] = {10, 100, 20};
-    int upper_brown[] = {20, 255, 200};
-
-    // Create masks and count colors
-     Mat mask_blue, mask_green, mask_yellow, mask_black, mask_white, mask_brown;
-    inRange(hsv, Scalar(lower_blue[0], lower_blue[1], lower_blue[2]), Scalar(upper_blue[0], upper_blue[1], upper_blue[2]), mask_blue);
-    inRange(hsv, Scalar(lower_green[0], lower_green[1], lower_green[2]), Scalar(upper_green[0], upper_green[1], upper_green[2]), mask_green);
-    inRange(hsv, Scalar(lower_yellow[0], lower_yellow[1], lower_yellow[2]), Scalar(upper_yellow[0], upper_yellow[1], upper_yellow[2]), mask_yellow);
-    inRange(hsv, Scalar(lower_black[0], lower_black[1], lower_black[2]), Scalar(upper_black[0], upper_black[1], upper_black[2]), mask_black);
-    inRange(hsv, Scalar(lower_white[0], lower_white[1], lower_white[2]), Scalar(upper_white[0], upper_white[1], upper_white[2]), mask_white);
-    inRange(hsv, Scalar(lower_brown[0], lower_brown[1], lower_brown[2]), Scalar(upper_brown[0], upper_brown[1], upper_brown[2]), mask_brown);
+// Function to calculate color intensity
+void calculateColorIntensity(const Mat& image, FrameStats& stats) {
+    // One pass over the frame for all colour ranges, see ColorClassifier.h
+    static const ColorClassifier classifier;
+    if (colorLut)
+        colorLut->classify(image.data, image.cols, image.rows, image.step, stats.counts);
+    else
+        classifier.classify(image.data, image.cols, image.rows, image.step, stats.counts);
+    // Percentages are left to the readers of the log
+    stats.pixels = image.rows * image.cols;
+}
 
-    // Count colors
-    data.blueCount = countNonZero(mask_blue);
-    data.greenCount = countNonZero(mask_green);
-    data.yellowCount = countNonZero(mask_yellow);
-    data.blackCount = countNonZero(mask_black);
-    data.whiteCount = countNonZero(mask_white);
-    data.brownCount = countNonZero(mask_brown);
-    
-    // Calculate total pixels in the image
-    int totalPixels = image.rows * image.cols;
+// All of text as a number within [min, max]
+static bool parseNumber(const std::string& text, long min, long max, long* value) {
+    char* end;
+    errno = 0;
+    long number = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end || errno || number < min || number > max)
+        return false;
+    *value = number;
+    return true;
+}
 
-    // Calculate color percentages
-    data.bluePercentage = (static_cast<int>(data.blueCount) / totalPixels) * 100;
-    data.greenPercentage = (static_cast<int>(data.greenCount) / totalPixels) * 100;
-    data.yellowPercentage = (static_cast<int>(data.yellowCount) / totalPixels) * 100;
-    data.blackPercentage = (static_cast<int>(data.blackCount) / totalPixels) * 100;
-    data.whitePercentage = (static_cast<int>(data.whiteCount) / totalPixels) * 100;
-    data.brownPercentage = (static_cast<int>(data.brownCount) / totalPixels) * 100;
+static bool parseNumber(const std::string& text, double min, double max, double* value) {
+    char* end;
+    errno = 0;
+    double number = strtod(text.c_str(), &end);
+    if (text.empty() || *end || errno || !(number >= min && number <= max))
+        return false;
+    *value = number;
+    return true;
 }
 
 // Function to create a directory if it does not exist
@@ -101,160 +106,576 @@ void createDirectory(const std::string& dirName) {
 int main(int argc, char* argv[]) {
     time_t start_time = time(0);
     int frame_count = 0;
-    LibCamera cam;
     uint32_t width = 1920;
     uint32_t height = 1080;
     uint32_t stride;
-    char key;
     const int capture_duration = 30; // Capture for 30 seconds
     const std::string videoFile = "output_video.mp4"; // Output video file
-    const std::string binaryFile = "frame_data.bin"; // Binary file for frame data
+    const std::string statsFile = "frame_stats.bin"; // Per-frame colour statistics, see FrameStatsLog.h
     const std::string dayFolder = "day";
     const std::string nightFolder = "night";
-    const std::string tempFolder = "temp";
     const std::string otherFolder = "other";
+    const std::string eventFolder = "events";
     
     // Create the "day" directory
       createDirectory(dayFolder);
     createDirectory(nightFolder);
-    createDirectory(tempFolder);
     
+    // Only the best frames are kept (in memory) and written at the end:
+    // ranked by dayClass if the run turns out to be daytime, nightClass if not.
+    int topFrames = 4;
+    // --analysis=WxH measures colours on a second, low resolution stream;
+    // the full size frames are then only read to keep the best ones.
+    uint32_t analysisWidth = 0;
+    uint32_t analysisHeight = 0;
+    int dayClass = Blue;
+    int nightClass = Yellow;
+    // --compress-stats delta codes new blocks of the stats log, for less
+    // SD card wear on long runs.
+    bool compressStats = false;
+    // --metrics=PORT serves Prometheus metrics on 127.0.0.1:PORT,
+    // --metrics=/path/to/socket on a Unix socket.
+    std::string metricsAddress;
+    // --trace=FILE writes a Chrome trace (chrome://tracing, Perfetto) of
+    // the last frames' spans at exit.
+    std::string traceFile;
+    // Frames keep their buffer while they are queued in the pipeline, so
+    // the camera needs enough to keep capturing meanwhile. --buffers=auto
+    // starts low and resizes to what the measured hold times need, within
+    // a budget (--buffers=auto:MB, 128 MB by default).
+    int bufferCount = 6;
+    size_t bufferBudget = 0;
+    // --fps=N fixes the sensor frame rate (10 by default); --fps=auto[:MIN-MAX]
+    // lets it follow what the pipeline keeps up with, 2-30 by default.
+    double fps = 10;
+    double minFps = 0;
+    // --config-cache=FILE keeps the camera, its validated streams and the
+    // settled exposure between runs for a faster cold start.
+    std::string configCache;
+    // The preview window shows frames scaled down to fit --preview=WxH[@FPS]
+    // (960x540 at 15 fps by default); --no-preview turns it off. Headless
+    // builds have no window.
+    uint32_t previewWidth = 960;
+    uint32_t previewHeight = 540;
+    double previewFps = 15;
+    bool showPreview = true;
+    // --tensors=NAME[,SIZE][,uint8] publishes every frame that makes the top
+    // frames as a preprocessed model input in /dev/shm/NAME (TensorRing.h),
+    // SIZExSIZE (256 by default) float32, for space_hawks.py --shm NAME.
+    std::string tensorName;
+    uint32_t tensorSize = 256;
+    TensorType tensorType = kTensorFloat32;
+    // --bus=/path/to/socket shares the frames with other local processes
+    // (FrameBus.h), each allowed to hold two at a time.
+    std::string busPath;
+    // --events=PRE:POST[:MB] keeps the last PRE seconds as JPEGs in MB of
+    // memory (64 by default) and saves them, and the next POST seconds,
+    // under events/ when the day or night colour's share of the frame jumps
+    // by --event-threshold=PCT points (10 by default) from its recent
+    // average. The continuous video is not written then.
+    double eventPre = 0;
+    double eventPost = 0;
+    size_t eventArena = 64 << 20;
+    double eventThreshold = 10;
 
     bool createOthersFolder = false;
-    if (argc > 1 && std::string(argv[1]) == "1") {
-        createOthersFolder = true;
-        createDirectory(otherFolder);
+    // Without a sensor, --synthetic[=fps] renders test frames and
+    // --replay=<path>[,fps] plays back recorded ones. fps 0 runs unthrottled.
+    std::unique_ptr<FrameSource> source;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "1") {
+            createOthersFolder = true;
+            createDirectory(otherFolder);
+        } else if (arg.rfind("--synthetic", 0) == 0) {
+            double fps = -1;
+            if (arg.size() > 11 && (arg[11] != '=' || !parseNumber(arg.substr(12), 0.0, 1000.0, &fps))) {
+                std::cerr << "Expected --synthetic[=FPS], FPS 0-1000" << std::endl;
+                return 1;
+            }
+            source = std::make_unique<SyntheticCamera>(fps);
+        } else if (arg.rfind("--replay=", 0) == 0) {
+            std::string path = arg.substr(9);
+            double fps = -1;
+            size_t comma = path.find(',');
+            if (comma != std::string::npos) {
+                if (!parseNumber(path.substr(comma + 1), 0.0, 1000.0, &fps)) {
+                    std::cerr << "Expected --replay=PATH[,FPS], FPS 0-1000" << std::endl;
+                    return 1;
+                }
+                path = path.substr(0, comma);
+            }
+            source = std::make_unique<ReplayCamera>(path, fps);
+        } else if (arg.rfind("--color-lut=", 0) == 0) {
+            long bits;
+            if (!parseNumber(arg.substr(12), 5L, 6L, &bits)) {
+                std::cerr << "Expected --color-lut=BITS, 5-6" << std::endl;
+                return 1;
+            }
+            colorLut = std::make_unique<ColorLut>(bits);
+        } else if (arg.rfind("--analysis=", 0) == 0) {
+            if (sscanf(arg.c_str() + 11, "%ux%u", &analysisWidth, &analysisHeight) != 2) {
+                std::cerr << "Expected --analysis=WIDTHxHEIGHT" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--fps=auto", 0) == 0) {
+            minFps = 2;
+            fps = 30;
+            size_t dash = arg.find('-', 11);
+            if (arg.size() > 10 && (arg[10] != ':' || dash == std::string::npos ||
+                                    !parseNumber(arg.substr(11, dash - 11), 0.1, 1000.0, &minFps) ||
+                                    !parseNumber(arg.substr(dash + 1), minFps, 1000.0, &fps))) {
+                std::cerr << "Expected --fps=auto:MIN-MAX, 0.1 <= MIN <= MAX <= 1000" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--fps=", 0) == 0) {
+            if (!parseNumber(arg.substr(6), 0.1, 1000.0, &fps)) {
+                std::cerr << "Expected --fps=FPS, 0.1-1000, or --fps=auto[:MIN-MAX]" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--buffers=auto", 0) == 0) {
+            long mb = 128;
+            if (arg.size() > 14 && (arg[14] != ':' || !parseNumber(arg.substr(15), 1L, 65536L, &mb))) {
+                std::cerr << "Expected --buffers=auto[:MB], MB 1-65536" << std::endl;
+                return 1;
+            }
+            bufferCount = 3;
+            bufferBudget = (size_t)mb << 20;
+        } else if (arg.rfind("--buffers=", 0) == 0) {
+            long count;
+            if (!parseNumber(arg.substr(10), 1L, 64L, &count)) {
+                std::cerr << "Expected --buffers=N, 1-64, or --buffers=auto[:MB]" << std::endl;
+                return 1;
+            }
+            bufferCount = count;
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            traceFile = arg.substr(8);
+        } else if (arg.rfind("--metrics=", 0) == 0) {
+            metricsAddress = arg.substr(10);
+        } else if (arg.rfind("--config-cache=", 0) == 0) {
+            configCache = arg.substr(15);
+        } else if (arg == "--no-preview") {
+            showPreview = false;
+        } else if (arg.rfind("--preview=", 0) == 0) {
+            if (sscanf(arg.c_str() + 10, "%ux%u@%lf", &previewWidth, &previewHeight, &previewFps) < 2) {
+                std::cerr << "Expected --preview=WIDTHxHEIGHT[@FPS]" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--tensors=", 0) == 0) {
+            std::stringstream spec(arg.substr(10));
+            std::string item;
+            long size;
+            std::getline(spec, tensorName, ',');
+            while (std::getline(spec, item, ',')) {
+                if (item == "uint8") {
+                    tensorType = kTensorUint8;
+                } else if (item == "float32") {
+                    tensorType = kTensorFloat32;
+                } else if (parseNumber(item, 1L, 4096L, &size)) {
+                    tensorSize = size;
+                } else {
+                    std::cerr << "Expected --tensors=NAME[,SIZE][,uint8], SIZE 1-4096" << std::endl;
+                    return 1;
+                }
+            }
+        } else if (arg.rfind("--bus=", 0) == 0) {
+            busPath = arg.substr(6);
+        } else if (arg.rfind("--events=", 0) == 0) {
+            unsigned int mb = 64;
+            if (sscanf(arg.c_str() + 9, "%lf:%lf:%u", &eventPre, &eventPost, &mb) < 2) {
+                std::cerr << "Expected --events=PRE:POST[:MB]" << std::endl;
+                return 1;
+            }
+            eventArena = (size_t)mb << 20;
+        } else if (arg.rfind("--event-threshold=", 0) == 0) {
+            if (!parseNumber(arg.substr(18), 0.0, 100.0, &eventThreshold)) {
+                std::cerr << "Expected --event-threshold=PCT, 0-100" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--compress-stats") {
+            compressStats = true;
+        } else if (arg.rfind("--top=", 0) == 0) {
+            long top;
+            if (!parseNumber(arg.substr(6), 0L, 100L, &top)) {
+                std::cerr << "Expected --top=N, 0-100" << std::endl;
+                return 1;
+            }
+            topFrames = top;
+        } else if (arg.rfind("--day-score=", 0) == 0 || arg.rfind("--night-score=", 0) == 0) {
+            size_t eq = arg.find('=');
+            int colorClass = colorClassByName(arg.substr(eq + 1));
+            if (colorClass < 0) {
+                std::cerr << "Unknown colour " << arg.substr(eq + 1) << std::endl;
+                return 1;
+            }
+            (arg[2] == 'd' ? dayClass : nightClass) = colorClass;
+        }
+    }
+    if (!source) {
+        std::unique_ptr<LibCamera> camera = std::make_unique<LibCamera>();
+        if (!configCache.empty())
+            camera->setConfigCache(configCache);
+        source = std::move(camera);
     }
+    FrameSource &cam = *source;
     
 
-    // Create a window for displaying the camera feed
-    cv::namedWindow("libcamera-demo", cv::WINDOW_NORMAL);
-    cv::resizeWindow("libcamera-demo", width, height); 
-
     int ret = cam.initCamera();
-    cam.configureStill(width, height, formats::RGB888, 1, 0);
+    cam.configureStill(width, height, formats::RGB888, bufferCount, 0, analysisWidth, analysisHeight, formats::RGB888);
     ControlList controls_;
-    int64_t frame_time = 1000000 / 10;
+    int64_t frame_time = 1000000 / fps;
     controls_.set(controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
     controls_.set(controls::Brightness, 0.5);
     controls_.set(controls::Contrast, 1.5);
-    controls_.set(controls::ExposureTime, 20000);
+    // A fixed exposure would stick and keep the cached one from seeding AE
+    if (configCache.empty())
+        controls_.set(controls::ExposureTime, 20000);
     cam.set(controls_);
-    int totalPixels ;
 
     if (!ret) {
-        bool flag;
-        LibcameraOutData frameData;
         cam.startCamera();
         cam.VideoStream(&width, &height, &stride);
-
-        // Initialize VideoWriter
-        cv::VideoWriter videoWriter(videoFile, cv::VideoWriter::fourcc('H', '2', '6', '4'), 30, cv::Size(width, height), true);
-        std::vector<FrameData> frameDataList;
+        uint32_t analysisStride;
+        cam.AnalysisStream(&analysisWidth, &analysisHeight, &analysisStride);
+
+        // Initialize VideoWriter at the highest rate the sensor will run at;
+        // the video stage places frames on it by their sensor timestamps.
+        bool recordEvents = eventPre > 0 || eventPost > 0;
+        cv::VideoWriter videoWriter;
+        if (!recordEvents)
+            videoWriter.open(videoFile, cv::VideoWriter::fourcc('H', '2', '6', '4'), fps, cv::Size(width, height), true);
+        const uint64_t videoInterval = 1e9 / fps;
+        uint64_t videoClock = 0;
+        // Appended to across runs, rows reach the disk as they come
+        FrameStatsWriter statsLog;
+        if (statsLog.open(statsFile, 4096, 64, compressStats))
+            std::cerr << "Error: Unable to open " << statsFile << " for writing." << std::endl;
+        TopKSelector dayFrames(topFrames, width * 3, height);
+        TopKSelector nightFrames(topFrames, width * 3, height);
+        uint64_t totalBlackCount = 0;
+        uint64_t totalPixels = 0;
+        // Encodes on worker threads, reading straight from the camera buffer
+        JpegEncoderPool encoder(2, 90, 2);
+        // Preallocated before capture starts; writes on a thread of its own
+        EventRecorder events;
+        if (recordEvents && events.start(eventFolder, eventPre, eventPost, eventArena))
+            recordEvents = false;
+        // Recent share of the day and night colours, -1 until the first frame
+        double eventBaseline[2] = { -1, -1 };
+
+        // Capture runs on this thread; analysis, video and JPEG output each
+        // get a thread of their own. A frame's buffer goes back to the camera
+        // when the last stage is done with it.
+        Pipeline<FramePtr> pipeline;
+        // Time from exposure to each point, printed at exit and on SIGUSR1
+        LatencyStats &latency = LatencyStats::global();
+        LatencyHistogram &analyzeLatency = latency.histogram("analyze");
+        LatencyHistogram &videoLatency = latency.histogram("video");
+        LatencyHistogram &encodeLatency = latency.histogram("encode");
+        LatencyStats::dumpOnSignal(SIGUSR1);
+        int analyzeStage = pipeline.addStage("analyze", [&](FramePtr &frame) {
+            Mat im(height, width, CV_8UC3, frame->frame.imageData(), stride);
+            FrameStats &stats = frame->stats;
+            {
+                TraceSpan span("calculateColorIntensity", frame->frame.sequence());
+                if (analysisWidth) {
+                    const FramePlane &plane = frame->frame.stream(kAnalysisStream).planes[0];
+                    calculateColorIntensity(Mat(analysisHeight, analysisWidth, CV_8UC3, plane.data, plane.stride), stats);
+                } else {
+                    calculateColorIntensity(im, stats);
+                }
+            }
+            statsLog.append(stats);
+            totalBlackCount += stats.counts[Black];
+            totalPixels += stats.pixels;
+
+            // Keep a copy only if it is one of the best so far
+            if (dayFrames.offer(stats.counts[dayClass], stats.frameID, im.data, stride)) {
+                frame->winner |= 1;
+                frame->score = stats.counts[dayClass];
+            }
+            if (nightFrames.offer(stats.counts[nightClass], stats.frameID, im.data, stride)) {
+                frame->winner |= 2;
+                frame->score = std::max<double>(frame->score, stats.counts[nightClass]);
+            }
+            if (recordEvents && stats.pixels) {
+                const int classes[2] = { dayClass, nightClass };
+                for (int i = 0; i < 2; i++) {
+                    double share = 100.0 * stats.counts[classes[i]] / stats.pixels;
+                    if (eventBaseline[i] >= 0 && fabs(share - eventBaseline[i]) > eventThreshold)
+                        events.trigger(kColorRanges[classes[i]].name, frame->frame.timestamp());
+                    eventBaseline[i] = eventBaseline[i] < 0 ? share : eventBaseline[i] * 0.9 + share * 0.1;
+                }
+            }
+            analyzeLatency.record(latencyClock() - frame->frame.timestamp());
+            return true;
+        }, 2, QueuePolicy::Block);
+        if (recordEvents) {
+            // Sees every frame analysis does, but falls behind by dropping
+            // rather than holding up capture.
+            pipeline.addStage("events", [&](FramePtr &frame) {
+                events.add(JpegInput::fromFrame(frame->frame.imageData(), formats::RGB888, width, height, stride),
+                           frame->stats.frameID, frame->frame.timestamp());
+                return true;
+            }, 2, QueuePolicy::DropOldest);
+        } else {
+            pipeline.addStage("video", [&](FramePtr &frame) {
+                Mat im(height, width, CV_8UC3, frame->frame.imageData(), stride);
+                {
+                    TraceSpan span("videoWriter.write", frame->frame.sequence());
+                    // Repeat a frame to cover for a lower sensor rate or lost
+                    // frames (up to a second's worth), skip one that is early.
+                    // Each frame fills the slots nearest its timestamp, so the
+                    // clock starts half a slot early and jitter on a frame at
+                    // the container rate neither skips nor doubles it.
+                    uint64_t timestamp = frame->frame.timestamp();
+                    if (!videoClock || timestamp > videoClock + 1000000000)
+                        videoClock = timestamp - videoInterval / 2;
+                    for (; videoClock <= timestamp; videoClock += videoInterval)
+                        videoWriter.write(im);
+                }
+                videoLatency.record(latencyClock() - frame->frame.timestamp());
+                return true;
+            }, 2, QueuePolicy::DropOldest);
+        }
+        // Candidates go to the inference process as they turn up, instead of
+        // as JPEGs at the end.
+        TensorRing tensors;
+        if (!tensorName.empty() && !tensors.open(tensorName, 8, tensorSize, tensorType)) {
+            pipeline.addStage("tensor", [&](FramePtr &frame) {
+                if (frame->winner)
+                    tensors.publish(frame->frame.imageData(), width, height, stride, frame->stats.frameID,
+                                    frame->frame.timestamp(), frame->score, frame->winner);
+                return true;
+            }, 2, QueuePolicy::DropOldest, analyzeStage);
+        }
+        if (createOthersFolder) {
+            pipeline.addStage("persist", [&](FramePtr &frame) {
+                // The encoder holds on to the frame until it has been read
+                std::string otherFilename = otherFolder + "/" + statsFilename(frame->stats.frameID);
+                encoder.submit(JpegInput::fromFrame(frame->frame.imageData(), formats::RGB888, width, height, stride),
+                               otherFilename, [frame, &encodeLatency](const JpegResult&) {
+                                   encodeLatency.record(latencyClock() - frame->frame.timestamp());
+                               });
+                return true;
+            }, 2, QueuePolicy::DropNewest);
+        }
+        pipeline.start();
+
+        // Everything here is read at scrape time from counters that are kept
+        // anyway, so the capture path pays nothing for it.
+        MetricsServer metrics;
+        metrics.addCollector([&cam](MetricsWriter &out) {
+            CaptureStats capture = cam.captureStats();
+            out.counter("capture_frames_total", "Frames read from the camera.", capture.frames);
+            out.counter("capture_lost_frames_total", "Gaps in the sensor sequence numbers.", capture.sequenceGaps);
+            out.counter("capture_cancelled_requests_total", "Requests that completed cancelled.", capture.cancelled);
+            out.counter("capture_empty_polls_total", "Reads that found no completed request.", capture.emptyPolls);
+            out.gauge("capture_requeue_seconds_avg", "Time from completion until the buffer was requeued.",
+                      capture.avgRequeueMs / 1e3);
+            out.gauge("capture_requeue_seconds_max", "Longest time from completion to requeue.",
+                      capture.maxRequeueMs / 1e3);
+            out.gauge("capture_first_frame_seconds", "Time from camera init to the first frame with settled exposure.",
+                      capture.firstFrameMs / 1e3);
+        });
+        metrics.addCollector([&pipeline](MetricsWriter &out) {
+            std::vector<Pipeline<FramePtr>::StageStats> stages = pipeline.stats();
+            struct Column {
+                const char *name, *type, *help;
+                double (*value)(const Pipeline<FramePtr>::StageStats &);
+            };
+            static const Column columns[] = {
+                { "pipeline_processed_total", "counter", "Frames a stage has processed.",
+                  [](const Pipeline<FramePtr>::StageStats &s) { return (double)s.processed; } },
+                { "pipeline_dropped_total", "counter", "Frames dropped by a stage's queue policy.",
+                  [](const Pipeline<FramePtr>::StageStats &s) { return (double)s.dropped; } },
+                { "pipeline_lost_upstream_total", "counter", "Frames an upstream stage's queue dropped before they reached a stage.",
+                  [](const Pipeline<FramePtr>::StageStats &s) { return (double)s.gaps; } },
+                { "pipeline_queue_depth", "gauge", "Frames waiting for a stage.",
+                  [](const Pipeline<FramePtr>::StageStats &s) { return (double)s.depth; } },
+                { "pipeline_queue_capacity", "gauge", "Queue size of a stage.",
+                  [](const Pipeline<FramePtr>::StageStats &s) { return (double)s.capacity; } },
+                { "pipeline_cpu_seconds_total", "counter", "CPU time of a stage thread.",
+                  [](const Pipeline<FramePtr>::StageStats &s) { return s.cpuMs / 1e3; } },
+            };
+            for (const Column &column : columns) {
+                out.family(column.name, column.type, column.help);
+                for (const Pipeline<FramePtr>::StageStats &s : stages)
+                    out.sample(column.name, column.value(s), "stage=\"" + s.name + "\"");
+            }
+        });
+        metrics.addCollector([&encoder](MetricsWriter &out) {
+            out.counter("jpeg_encoded_total", "Frames JPEG encoded.", encoder.encodedFrames());
+            out.gauge("jpeg_backlog", "Encodes queued or running.", encoder.backlog());
+            out.gauge("jpeg_encode_seconds_avg", "Average encode time.", encoder.averageEncodeMs() / 1e3);
+        });
+        metrics.addCollector([&latency](MetricsWriter &out) {
+            out.family("frame_latency_seconds", "summary", "Frame latency at each point, see LatencyStats.h.");
+            latency.forEach([&out](const std::string &name, const LatencyHistogram &h) {
+                std::string point = "point=\"" + name + "\"";
+                for (const char *q : { "0.5", "0.9", "0.99" })
+                    out.sample("frame_latency_seconds", h.percentile(atof(q) * 100) / 1e9,
+                               point + ",quantile=\"" + q + "\"");
+                out.sample("frame_latency_seconds_sum", h.sum() / 1e9, point);
+                out.sample("frame_latency_seconds_count", h.count(), point);
+            });
+        });
+        FrameBus bus;
+        if (!busPath.empty() && !bus.start(busPath, 2)) {
+            metrics.addCollector([&bus](MetricsWriter &out) {
+                out.counter("bus_frames_total", "Frames sent to frame bus subscribers.", bus.sentFrames());
+                out.counter("bus_skipped_total", "Frames a subscriber missed holding too many.", bus.skippedFrames());
+                out.gauge("bus_subscribers", "Processes connected to the frame bus.", bus.subscribers());
+            });
+        }
+        if (recordEvents) {
+            metrics.addCollector([&events](MetricsWriter &out) {
+                out.counter("events_total", "Events triggered.", events.events());
+                out.counter("events_written_frames_total", "Frames saved around events.", events.writtenFrames());
+                out.counter("events_dropped_frames_total", "Frames not kept, the event buffer being full of unsaved ones.",
+                            events.droppedFrames());
+                out.gauge("events_buffered_frames", "Frames held in the event buffer.", events.storedFrames());
+                out.gauge("events_buffer_used_bytes", "Event buffer bytes in use.", events.arenaUsed());
+                out.gauge("events_buffer_bytes", "Size of the event buffer.", events.arenaSize());
+            });
+        }
+        if (!metricsAddress.empty() && metrics.start(metricsAddress)) {
+            bus.stop();
+            pipeline.stop();
+            cam.stopCamera();
+            cam.closeCamera();
+            return 1;
+        }
+        if (!traceFile.empty())
+            Trace::start();
+        auto loop_start = std::chrono::steady_clock::now();
+        auto last_tuned = loop_start;
+        // --fps=auto: once a second, retune the sensor to what analysis
+        // keeps up with. It is the stage that must see every frame; video
+        // and JPEG output drop by design, and the video stage writes at the
+        // container rate whatever the sensor does. It goes by wall time per
+        // frame rather than the thread's CPU time: time spent waiting for a
+        // core or on page faults limits throughput just the same.
+        FrameRateController rateController(minFps, fps);
+        auto last_rate_check = loop_start;
+        Pipeline<FramePtr>::StageStats lastAnalyze = pipeline.stats()[analyzeStage];
+        // Draws on a thread of its own; capture only pays for a scaled copy
+        // now and then.
+        Preview preview("libcamera-demo", previewWidth, previewHeight, previewFps);
+        if (showPreview)
+            preview.start();
 
         while (difftime(time(0), start_time) < capture_duration) {  // Run for the defined duration
-            flag = cam.readFrame(&frameData);
-            if (!flag)
+            Frame next = cam.nextFrame(100);
+            if (!next)
                 continue;
+            FramePtr frame = std::make_shared<CapturedFrame>();
+            frame->frame = std::move(next);
 
-            Mat im(height, width, CV_8UC3, frameData.imageData, stride);
-            imshow("libcamera-demo", im);
-            key = waitKey(1);
-            if (key == 'q') {
+            preview.offer(frame->frame.imageData(), width, height, stride, frame->frame.sequence());
+            if (preview.key() == 'q') {
                 break;
             }
 
-            // Write frame to video
-            videoWriter.write(im);
-
-            // Record FrameData with timestamp
-            FrameData data;
-            data.frameID = frame_count;
-            data.timestamp = time(0);
-            snprintf(data.filename, sizeof(data.filename), "frame_%d.jpg", frame_count);
-            
-            // Calculate color intensities
-            calculateColorIntensity(im, data);
-            frameDataList.push_back(data); // Store frame data in a list
-            std::string tempFilename = tempFolder + "/" + data.filename;
-            totalPixels = im.rows * im.cols;
-
-            // Save the frame image as well
-            imwrite(tempFilename, im); // Save the current frame as an image file
+            // Stamp the frame; analysis fills in the rest
+            frame->stats.frameID = frame_count;
+            frame->stats.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
 
+            // Subscribers and the pipeline share the buffer; it is requeued
+            // once all of them are done.
+            bus.publish(frame->frame.data(), frame);
+            pipeline.push(std::move(frame));
             frame_count++;
-            cam.returnFrameBuffer(frameData);
-        }
-
-        // Save frame data to a binary file
-        saveFrameData(frameDataList, binaryFile);
-
-        // Sort frames based on blue intensity
-        std::sort(frameDataList.begin(), frameDataList.end(), [](const FrameData& a, const FrameData& b) {
-            return a.blueCount > b.blueCount; // Sort in descending order
-        });
-
-        bool isDay = false;
 
-        std::vector<FrameData> dayFrames;
+            if (LatencyStats::dumpRequested())
+                latency.print(stderr);
+
+            if (minFps && std::chrono::steady_clock::now() - last_rate_check > std::chrono::seconds(1)) {
+                last_rate_check = std::chrono::steady_clock::now();
+                Pipeline<FramePtr>::StageStats analyze = pipeline.stats()[analyzeStage];
+                uint64_t frames = analyze.processed - lastAnalyze.processed;
+                double analyzeMs = frames ? (analyze.avgMs * analyze.processed -
+                                             lastAnalyze.avgMs * lastAnalyze.processed) / frames : 0;
+                // A full queue means capture is already waiting on analysis
+                bool backlogged = analyze.depth >= analyze.capacity;
+                lastAnalyze = analyze;
+                if (rateController.update(analyzeMs, backlogged)) {
+                    int64_t duration = rateController.frameDurationUs();
+                    ControlList rate;
+                    rate.set(controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ duration, duration }));
+                    cam.set(rate);
+                    printf("Frame rate: %.1f fps\n", rateController.fps());
+                }
+            }
 
-        // Evaluate Day 1 --- Criteria blue green 
-        if (!isDay) {
-            for (const FrameData& frame : frameDataList) {
-                 double bluePercentage = (static_cast<double>(frame.blueCount) / totalPixels) * 100;
-                if (bluePercentage > 30.0) {
-                    isDay = true;
-                    dayFrames.push_back(frame); 
+            // Resize the buffer pool at most every 10 s: grow as soon as
+            // hold times call for it, shrink only by more than one buffer
+            // so it doesn't flap.
+            if (bufferBudget && std::chrono::steady_clock::now() - last_tuned > std::chrono::seconds(10)) {
+                last_tuned = std::chrono::steady_clock::now();
+                int wanted = cam.recommendedBufferCount(bufferBudget);
+                if (wanted && (wanted > bufferCount || wanted + 1 < bufferCount)) {
+                    printf("Buffers: %d -> %d\n", bufferCount, wanted);
+                    // Every frame has to be back before the camera restarts
+                    bus.reset();
+                    pipeline.drain();
+                    encoder.wait();
+                    bufferCount = wanted;
+                    if (cam.resetCamera(width, height, formats::RGB888, bufferCount, 0)) {
+                        std::cerr << "Failed to restart the camera" << std::endl;
+                        break;
+                    }
                 }
-            } 
-        std::sort(dayFrames.begin(), dayFrames.end(), [](const FrameData& a, const FrameData& b) -> bool {
-            return a.greenCount > b.blueCount;
-        });
-       }
+                cam.resetBufferTuning();
+            }
+        }
 
-        // Determine if it's day or night based on black pixels
-        const int totalFrames = frameDataList.size();
-        int totalBlackCount = 0;
+        metrics.stop();
+        preview.stop();
+        bus.stop();
+        pipeline.stop();
+        // Finishes writing the event in progress
+        events.stop();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - loop_start).count();
+        if (frame_count) {
+            printf("%s: %d frames in %.1f s (%.2f fps)\n",
+                   cam.getCameraId(), frame_count, elapsed, frame_count / elapsed);
+            pipeline.printStats();
+            CaptureStats capture = cam.captureStats();
+            printf("Capture: %lu frames, %lu lost (sequence gaps), %lu cancelled, %lu empty polls, "
+                   "requeued after %.2f ms avg / %.2f ms max\n",
+                   (unsigned long)capture.frames, (unsigned long)capture.sequenceGaps,
+                   (unsigned long)capture.cancelled, (unsigned long)capture.emptyPolls,
+                   capture.avgRequeueMs, capture.maxRequeueMs);
+            if (capture.firstFrameMs)
+                printf("First usable frame %.1f ms after camera init\n", capture.firstFrameMs);
+            if (recordEvents)
+                printf("Events: %lu, %lu frames saved, %lu dropped\n", (unsigned long)events.events(),
+                       (unsigned long)events.writtenFrames(), (unsigned long)events.droppedFrames());
+        }
 
-        for (const FrameData& frame : frameDataList) {
-            totalBlackCount += frame.blackCount;
+        encoder.wait();
+        latency.print();
+        if (!traceFile.empty()) {
+            Trace::stop();
+            Trace::write(traceFile);
         }
+        statsLog.close();
 
-        // Calculate the percentage of black pixels
-        double blackPixelPercentage = (static_cast<double>(totalBlackCount) / (totalFrames * width * height)) * 100;
+        // Determine if it's day or night based on the percentage of black pixels
+        double blackPixelPercentage = totalPixels ? static_cast<double>(totalBlackCount) / totalPixels * 100 : 0;
 
         if (blackPixelPercentage < 50.0) { // Daytime condition
-            // Save the top 4 highest blue intensity images
-            for (int i = 0; i < std::min(4, static_cast<int>(frameDataList.size())); ++i) {
-                const FrameData& topFrame = frameDataList[i];
-                // Load the original image using the frame ID or filename if available
-                Mat image = imread(topFrame.filename);
-                if (!image.empty()) {
-                    // Save the top images in the day folder
-                    std::string newFilename = dayFolder + "/top_blue_frame_" + std::to_string(i + 1) + ".jpg";
-                    imwrite(newFilename, image);
-                }
-            }
+            // Save the top highest intensity images in the day folder
+            saveTopFrames(encoder, dayFrames, width, dayFolder, kColorRanges[dayClass].name);
         } else { // Nighttime condition
-            // Sort frames based on yellow intensity
-            std::sort(frameDataList.begin(), frameDataList.end(), [](const FrameData& a, const FrameData& b) {
-                return a.yellowCount > b.yellowCount; // Sort in descending order
-            });
-
-            // Save the top 4 highest yellow intensity images
-            for (int i = 0; i < std::min(4, static_cast<int>(frameDataList.size())); ++i) {
-                const FrameData& topFrame = frameDataList[i];
-                // Load the original image using the frame ID or filename if available
-                Mat image = imread(topFrame.filename);
-                if (!image.empty()) {
-                    // Save the top images in the day folder
-                    std::string newFilename = nightFolder + "/top_yellow_frame_" + std::to_string(i + 1) + ".jpg";
-                    imwrite(newFilename, image);
-                }
-            }
+            saveTopFrames(encoder, nightFrames, width, nightFolder, kColorRanges[nightClass].name);
         }
+        if (encoder.encodedFrames())
+            printf("JPEG: %lu frames encoded, %.2f ms avg / %.2f ms max\n",
+                   (unsigned long)encoder.encodedFrames(), encoder.averageEncodeMs(), encoder.maxEncodeMs());
 
-        destroyAllWindows();
         cam.stopCamera();
         videoWriter.release();
     }
@@ -0,0 +1,156 @@
+#include <chrono>
+#include <errno.h>
+#include <iostream>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ColorClassifier.h"
+#include "LibCamera.h"
+#include "MultiCapture.h"
+#include "SimulatedCamera.h"
+
+// Captures from several cameras at once through MultiCapture and reports
+// each camera's frame rate, and with --sync=MS how many frame sets came
+// together within MS of each other. Every frame's colours are classified on
+// its camera's thread as stand-in work, so the total rate shows whether
+// throughput scales with the number of cameras. --synthetic[=fps] uses that
+// many SyntheticCameras (--cameras=N, 2 by default) instead of sensors.
+//
+//   multicam [--synthetic[=fps]] [--cameras=N] [--sync=MS] [--seconds=S] [width height]
+
+// All of text as a number within [min, max]
+static bool parseNumber(const std::string &text, long min, long max, long *value) {
+    char *end;
+    errno = 0;
+    long number = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end || errno || number < min || number > max)
+        return false;
+    *value = number;
+    return true;
+}
+
+static bool parseNumber(const std::string &text, double min, double max, double *value) {
+    char *end;
+    errno = 0;
+    double number = strtod(text.c_str(), &end);
+    if (text.empty() || *end || errno || !(number >= min && number <= max))
+        return false;
+    *value = number;
+    return true;
+}
+
+static int usage() {
+    std::cerr << "Usage: multicam [--synthetic[=fps]] [--cameras=N] [--sync=MS] [--seconds=S] [width height]"
+              << std::endl;
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    bool synthetic = false;
+    double syntheticFps = 30;
+    unsigned int count = 0;
+    double syncMs = -1;
+    int seconds = 10;
+    std::vector<int> numbers;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        long value;
+        if (arg.rfind("--synthetic", 0) == 0) {
+            synthetic = true;
+            if (arg.size() > 11 && (arg[11] != '=' || !parseNumber(arg.substr(12), 0.0, 1000.0, &syntheticFps)))
+                return usage();
+        } else if (arg.rfind("--cameras=", 0) == 0) {
+            if (!parseNumber(arg.substr(10), 1L, 16L, &value))
+                return usage();
+            count = value;
+        } else if (arg.rfind("--sync=", 0) == 0) {
+            if (!parseNumber(arg.substr(7), 0.0, 10000.0, &syncMs))
+                return usage();
+        } else if (arg.rfind("--seconds=", 0) == 0) {
+            if (!parseNumber(arg.substr(10), 1L, 86400L, &value))
+                return usage();
+            seconds = value;
+        } else {
+            if (!parseNumber(arg, 1L, 16384L, &value))
+                return usage();
+            numbers.push_back(value);
+        }
+    }
+    int width = numbers.size() > 1 ? numbers[0] : 1280;
+    int height = numbers.size() > 1 ? numbers[1] : 720;
+
+    // Held until the cameras are open, so the manager that listed them is
+    // the one they are opened from.
+    std::shared_ptr<CameraManager> manager;
+    std::vector<std::unique_ptr<FrameSource>> cameras;
+    if (synthetic) {
+        for (unsigned int i = 0; i < (count ? count : 2); i++)
+            cameras.push_back(std::make_unique<SyntheticCamera>(syntheticFps));
+    } else {
+        manager = LibCamera::cameraManager();
+        std::vector<std::string> ids = LibCamera::cameraIds();
+        for (unsigned int i = 0; i < ids.size() && (!count || i < count); i++)
+            cameras.push_back(std::make_unique<LibCamera>(ids[i]));
+    }
+    if (cameras.empty()) {
+        std::cerr << "No cameras found" << std::endl;
+        return 1;
+    }
+
+    std::vector<FrameSource *> sources;
+    for (std::unique_ptr<FrameSource> &camera : cameras) {
+        if (camera->initCamera())
+            return 1;
+        camera->configureStill(width, height, formats::RGB888, 4, 0);
+        if (camera->startCamera())
+            return 1;
+        sources.push_back(camera.get());
+    }
+
+    ColorClassifier classifier;
+    auto classify = [&](unsigned int index, const Frame &frame) {
+        uint32_t w, h, stride;
+        sources[index]->VideoStream(&w, &h, &stride);
+        uint32_t counts[kColorClasses];
+        classifier.classify(frame.imageData(), w, h, stride, counts);
+    };
+
+    MultiCapture capture(sources);
+    if (syncMs >= 0) {
+        capture.onFrameSet([&](FrameSet &set) {
+            for (unsigned int i = 0; i < set.frames.size(); i++)
+                classify(i, set.frames[i]);
+        }, syncMs * 1e6);
+    } else {
+        capture.onFrame([&](unsigned int index, Frame frame) { classify(index, frame); });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    capture.start();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    capture.stop();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < capture.cameras(); i++) {
+        CaptureStats stats = sources[i]->captureStats();
+        printf("%s: %lu frames (%.2f fps), %lu lost\n", sources[i]->getCameraId(), (unsigned long)capture.frames(i),
+               capture.frames(i) / elapsed, (unsigned long)stats.sequenceGaps);
+        total += capture.frames(i);
+    }
+    printf("Total: %.2f fps from %u cameras\n", total / elapsed, capture.cameras());
+    if (syncMs >= 0)
+        printf("Sets: %lu (%.2f/s) within %.1f ms, max skew %.2f ms, %lu frames unmatched\n",
+               (unsigned long)capture.sets(), capture.sets() / elapsed, syncMs, capture.maxSkew() / 1e6,
+               (unsigned long)capture.unmatched());
+
+    for (std::unique_ptr<FrameSource> &camera : cameras) {
+        camera->stopCamera();
+        camera->closeCamera();
+    }
+    return 0;
+}
@@ -1,48 +1,148 @@
 #include <iostream>
-#include <fstream>
-#include <vector>
+#include <chrono>
 #include <ctime>
+#include <errno.h>
 #include <iomanip>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "FrameStatsLog.h"
+#include "StatsQuery.h"
 
-struct FrameData {
-    int frameID;
-    time_t timestamp;
-    float blueIntensity;
-    float greenIntensity;
-    float brownIntensity;
-    float whiteIntensity;
-    float blackIntensity;
-    float yellowIntensity;
-    char filename[50];
-};
-
-void printFrameData(const FrameData& frameData) {
-    std::cout << "Frame ID: " << frameData.frameID << std::endl;
-    std::cout << "Timestamp: " << std::put_time(std::localtime(&frameData.timestamp), "%Y-%m-%d %H:%M:%S") << std::endl;
-    std::cout << "Blue Intensity: " << frameData.blueIntensity << std::endl;
-    std::cout << "Green Intensity: " << frameData.greenIntensity << std::endl;
-    std::cout << "Brown Intensity: " << frameData.brownIntensity << std::endl;
-    std::cout << "White Intensity: " << frameData.whiteIntensity << std::endl;
-    std::cout << "Black Intensity: " << frameData.blackIntensity << std::endl;
-    std::cout << "Yellow Intensity: " << frameData.yellowIntensity << std::endl;
-    std::cout << "Filename: " << frameData.filename << std::endl;
+void printFrameStats(const FrameStats& stats) {
+    time_t seconds = stats.timestamp / 1000000;
+    std::cout << "Frame ID: " << stats.frameID << std::endl;
+    std::cout << "Timestamp: " << std::put_time(std::localtime(&seconds), "%Y-%m-%d %H:%M:%S")
+              << "." << std::setw(3) << std::setfill('0') << (stats.timestamp / 1000) % 1000
+              << std::setfill(' ') << std::endl;
+    for (int c = 0; c < kColorClasses; c++) {
+        std::string name = kColorRanges[c].name;
+        name[0] = toupper(name[0]);
+        double intensity = stats.pixels ? 100.0 * stats.counts[c] / stats.pixels : 0;
+        std::cout << name << " Intensity: " << intensity << std::endl;
+    }
+    std::cout << "Filename: " << statsFilename(stats.frameID) << std::endl;
     std::cout << "------------------------------" << std::endl;
 }
 
-int main() {
-    std::string filename = "frame_data.bin";
-    std::ifstream file(filename, std::ios::binary);
+static int colorClassByName(const std::string& name) {
+    for (int c = 0; c < kColorClasses; c++)
+        if (name == kColorRanges[c].name)
+            return c;
+    return -1;
+}
+
+// Seconds since the epoch, or local time as YYYY-MM-DD[THH:MM[:SS]];
+// returns microseconds.
+static bool parseTime(const std::string& text, int64_t* us) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *formats[] = { "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d" };
+    for (const char *format : formats) {
+        const char *end = strptime(text.c_str(), format, &tm);
+        if (end && !*end) {
+            tm.tm_isdst = -1;
+            *us = static_cast<int64_t>(mktime(&tm)) * 1000000;
+            return true;
+        }
+    }
+    char *end;
+    double seconds = strtod(text.c_str(), &end);
+    if (end == text.c_str() || *end)
+        return false;
+    *us = static_cast<int64_t>(seconds * 1000000);
+    return true;
+}
+
+// COLOR>VALUE or COLOR>VALUE%
+static bool parseThreshold(const std::string& text, Threshold* threshold) {
+    size_t gt = text.find('>');
+    if (gt == std::string::npos)
+        return false;
+    threshold->colorClass = colorClassByName(text.substr(0, gt));
+    std::string value = text.substr(gt + 1);
+    threshold->percent = !value.empty() && value.back() == '%';
+    if (threshold->percent)
+        value.pop_back();
+    char *end;
+    threshold->value = strtod(value.c_str(), &end);
+    return threshold->colorClass >= 0 && !value.empty() && !*end;
+}
+
+static void usage() {
+    std::cerr << "Usage: readbin [file] [--from=TIME] [--to=TIME] [--top=K --by=COLOR] [--count=COLOR>N[%]]...\n"
+              << "  TIME is seconds since the epoch or local YYYY-MM-DD[THH:MM[:SS]].\n"
+              << "  Without --top or --count, prints every frame in the time range." << std::endl;
+}
 
-    if (!file) {
+int main(int argc, char* argv[]) {
+    std::string filename = "frame_stats.bin";
+    TimeRange range;
+    size_t topK = 0;
+    int topClass = -1;
+    std::vector<std::pair<std::string, Threshold>> thresholds;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        bool ok = true;
+        if (arg.rfind("--from=", 0) == 0) {
+            ok = parseTime(value, &range.from);
+        } else if (arg.rfind("--to=", 0) == 0) {
+            ok = parseTime(value, &range.to);
+        } else if (arg.rfind("--top=", 0) == 0) {
+            char *end;
+            errno = 0;
+            long k = strtol(value.c_str(), &end, 10);
+            ok = !value.empty() && !*end && !errno && k >= 0;
+            topK = ok ? k : 0;
+        } else if (arg.rfind("--by=", 0) == 0) {
+            topClass = colorClassByName(value);
+            ok = topClass >= 0;
+        } else if (arg.rfind("--count=", 0) == 0) {
+            Threshold threshold;
+            ok = parseThreshold(value, &threshold);
+            thresholds.emplace_back(value, threshold);
+        } else if (arg.rfind("--", 0) != 0) {
+            filename = arg;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage();
+            return 1;
+        }
+    }
+    if (topK && topClass < 0) {
+        usage();
+        return 1;
+    }
+
+    FrameStatsLog log;
+    if (log.open(filename)) {
         std::cerr << "Error opening file: " << filename << std::endl;
         return 1;
     }
+    StatsQuery query(log);
 
-    FrameData frameData;
-    while (file.read(reinterpret_cast<char*>(&frameData), sizeof(FrameData))) {
-        printFrameData(frameData);
+    if (!topK && thresholds.empty()) {
+        query.forEach(range, printFrameStats);
+        return 0;
     }
 
-    file.close();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t rows = query.rows(range);
+    for (const auto& threshold : thresholds) {
+        uint64_t count = query.count(range, threshold.second);
+        std::cout << threshold.first << ": " << count << " of " << rows << " frames" << std::endl;
+    }
+    if (topK) {
+        for (const FrameStats& stats : query.top(range, topClass, topK))
+            printFrameStats(stats);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << log.rows() << " frames in " << log.blockCount() << " blocks, queried in " << ms << " ms" << std::endl;
     return 0;
 }
@@ -6,6 +6,8 @@ import time
 import os
 import struct
 import json
+import mmap
+import sys
 from pycoral.adapters.common import input_size
 from pycoral.adapters.classify import get_classes
 from pycoral.adapters.detect import BBox
@@ -44,19 +46,60 @@ def read_inference_image(image, img_size=(256, 256), normalize=False):
         print(f"Exception in reading image: {e}")
         return None
 
-# Function to perform inference on a single image
-def inference(interpreter, img, output_path, img_size, index, folder_name):
-    original_image_path = os.path.join(output_path, folder_name, "originalCropped")
-    os.makedirs(original_image_path, exist_ok=True)
-    cv2.imwrite(os.path.join(original_image_path, f"original_image_{index}.jpg"), img)
-
-    img_infer = read_inference_image(img, img_size, normalize=True)
-    if img_infer is None:
-        print(f"Skipping inference for image index {index} due to preprocessing error.")
-        return
-
+# Preprocessed tensors published by libcamera-demo --tensors=NAME, see
+# TensorRing.h for the layout. Tensors are numpy views of the shared memory,
+# valid until the writer laps the ring: check still_valid() after using one.
+class TensorRing:
+    HEADER = struct.Struct("<8s8I")
+    SLOT = struct.Struct("<QQQdI")
+    SLOT_HEADER_SIZE = 64
+
+    def __init__(self, name):
+        with open(os.path.join("/dev/shm", name), "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+        (magic, version, self.slots, height, width, channels, dtype,
+         self.slot_size, self.data_offset) = self.HEADER.unpack_from(self.map, 0)
+        if magic != b"TNSRING1" or version != 1:
+            raise ValueError(f"{name} is not a tensor ring")
+        self.published = np.frombuffer(self.map, np.uint64, 1, 40)
+        dtype = np.float32 if dtype == 1 else np.uint8
+        count = height * width * channels
+        self.sequences = []
+        self.tensors = []
+        for i in range(self.slots):
+            offset = self.data_offset + i * self.slot_size
+            self.sequences.append(np.frombuffer(self.map, np.uint64, 1, offset))
+            self.tensors.append(np.frombuffer(self.map, dtype, count, offset + self.SLOT_HEADER_SIZE)
+                                .reshape(height, width, channels))
+        self.next_index = int(self.published[0])
+
+    # Waits for the next tensor and returns (n, tensor, frame_id, timestamp,
+    # score, tag), skipping any that were overwritten before they were read.
+    def next(self, poll_interval=0.005):
+        while True:
+            published = int(self.published[0])
+            if published > self.next_index:
+                n = max(self.next_index, published - self.slots)
+                self.next_index = n + 1
+                slot = n % self.slots
+                if int(self.sequences[slot][0]) != n + 1:
+                    continue
+                _, frame_id, timestamp, score, tag = self.SLOT.unpack_from(
+                    self.map, self.data_offset + slot * self.slot_size)
+                return n, self.tensors[slot], frame_id, timestamp, score, tag
+            time.sleep(poll_interval)
+
+    def still_valid(self, n):
+        return int(self.sequences[n % self.slots][0]) == n + 1
+
+# Function to perform inference on a preprocessed image. input_valid, if
+# given, is asked once the input has been copied into the interpreter.
+def run_model(interpreter, img_infer, output_path, index, folder_name, input_valid=None):
     img_infer_expanded = np.expand_dims(img_infer, axis=0)
     common.set_input(interpreter, img_infer_expanded)
+    if input_valid and not input_valid():
+        print(f"Input {index} was overwritten while being read, skipped")
+        return
     interpreter.invoke()
 
     output_tensor = common.output_tensor(interpreter, 0)
@@ -71,6 +114,30 @@ def inference(interpreter, img, output_path, img_size, index, folder_name):
 
     print(f"Inference result {index} saved at {output_image_path}")
 
+# Function to perform inference on a single image
+def inference(interpreter, img, output_path, img_size, index, folder_name):
+    original_image_path = os.path.join(output_path, folder_name, "originalCropped")
+    os.makedirs(original_image_path, exist_ok=True)
+    cv2.imwrite(os.path.join(original_image_path, f"original_image_{index}.jpg"), img)
+
+    img_infer = read_inference_image(img, img_size, normalize=True)
+    if img_infer is None:
+        print(f"Skipping inference for image index {index} due to preprocessing error.")
+        return
+
+    run_model(interpreter, img_infer, output_path, index, folder_name)
+
+# Function to run inference on tensors as libcamera-demo publishes them
+def run_inference_on_ring(interpreter, name, output_path):
+    ring = TensorRing(name)
+    print(f"Waiting for tensors in /dev/shm/{name}")
+    while True:
+        n, tensor, frame_id, timestamp, score, tag = ring.next()
+        if tensor.dtype == np.uint8:
+            tensor = tensor.astype(np.float32) / 255.0
+        folder_name = "day" if tag & 1 else "night"
+        run_model(interpreter, tensor, output_path, frame_id, folder_name, lambda: ring.still_valid(n))
+
 # Function to run inference on all images in day and night folders
 def run_inference_on_folder(interpreter, folder_name, output_path, img_size):
     folder_path = os.path.join(".", folder_name)  # Assuming day and night folders are in the current directory
@@ -98,7 +165,11 @@ if __name__ == "__main__":
         print(f"Failed to load model: {e}")
         exit(1)
 
-    # Run inference on 'day' and 'night' folders
-    for folder in ["day", "night"]:
-        run_inference_on_folder(interpreter, folder, output_path, img_size)
+    # With --shm NAME, take tensors straight from libcamera-demo --tensors=NAME;
+    # otherwise run inference on the 'day' and 'night' folders
+    if len(sys.argv) > 2 and sys.argv[1] == "--shm":
+        run_inference_on_ring(interpreter, sys.argv[2], output_path)
+    else:
+        for folder in ["day", "night"]:
+            run_inference_on_folder(interpreter, folder, output_path, img_size)
 